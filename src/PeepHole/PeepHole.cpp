@@ -1,524 +1,3075 @@
-#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/CmpInstAnalysis.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/LazyValueInfo.h"
 #include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/IR/PatternMatch.h"
 #include "llvm/Pass.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/DivisionByConstantInfo.h"
+#include "llvm/Support/KnownBits.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
 #include <bits/stdc++.h>
 
+// InstructionWorklist.h logs through LLVM_DEBUG, so the debug type has to be
+// defined before it is included
+#define DEBUG_TYPE "peephole"
+#include "llvm/Transforms/Utils/InstructionWorklist.h"
+
 using namespace llvm;
 using namespace llvm::PatternMatch;
 
-namespace {
-class TransformationVerifier {
-private:
-  // Track dependencies between instructions
-  struct DependencyInfo {
-    SmallPtrSet<Instruction *, 8> RAW; // Read-after-write
-    SmallPtrSet<Instruction *, 8> WAW; // Write-after-write
-    SmallPtrSet<Instruction *, 8> WAR; // Write-after-read
-  };
+namespace {
+// A rewrite described without touching the IR. Rules fill in a plan, the
+// verifier checks it and only approved plans are materialized, so a rejected
+// rewrite never leaves orphaned instructions behind. A plan is a list of
+// steps whose operands are existing values or the results of earlier steps;
+// its result may also simply forward an existing value.
+class RewritePlan {
+public:
+  // An existing value or the result of one of the plan's steps
+  class Ref {
+    Value *V = nullptr;
+    int Step = -1;
+
+  public:
+    Ref(Value *V) : V(V) {}
+    static Ref step(unsigned Index) {
+      Ref R(nullptr);
+      R.Step = Index;
+      return R;
+    }
+    bool isStep() const { return Step >= 0; }
+    unsigned getStep() const { return Step; }
+    Value *getValue() const { return V; }
+  };
+
+  struct Step {
+    unsigned Opcode;
+    Type *Ty;
+    SmallVector<Ref, 2> Ops;
+    CmpInst::Predicate Pred = CmpInst::BAD_ICMP_PREDICATE;
+    Intrinsic::ID IID = Intrinsic::not_intrinsic;
+    bool HasNUW = false;
+    bool HasNSW = false;
+    FastMathFlags FMF{};
+
+    Step(unsigned Opcode, Type *Ty, ArrayRef<Ref> Ops)
+        : Opcode(Opcode), Ty(Ty), Ops(Ops.begin(), Ops.end()) {}
+  };
+
+  Ref binOp(Instruction::BinaryOps Opcode, Ref LHS, Ref RHS) {
+    assert(getType(LHS) == getType(RHS) && "Operand types differ!");
+    return addStep(Step(Opcode, getType(LHS), {LHS, RHS}));
+  }
+
+  Ref cast(Instruction::CastOps Opcode, Ref V, Type *DestTy) {
+    return addStep(Step(Opcode, DestTy, {V}));
+  }
+
+  Ref icmp(CmpInst::Predicate Pred, Ref LHS, Ref RHS) {
+    assert(getType(LHS) == getType(RHS) && "Operand types differ!");
+    Step S(Instruction::ICmp, CmpInst::makeCmpResultType(getType(LHS)),
+           {LHS, RHS});
+    S.Pred = Pred;
+    return addStep(std::move(S));
+  }
+
+  Ref select(Ref Cond, Ref TrueV, Ref FalseV) {
+    assert(getType(TrueV) == getType(FalseV) && "Operand types differ!");
+    return addStep(
+        Step(Instruction::Select, getType(TrueV), {Cond, TrueV, FalseV}));
+  }
+
+  // A call to an intrinsic overloaded on the type of its first operand,
+  // which is also the type of the result, e.g. llvm.smax or llvm.ctpop
+  Ref intrinsic(Intrinsic::ID IID, ArrayRef<Ref> Ops) {
+    Step S(Instruction::Call, getType(Ops[0]), Ops);
+    S.IID = IID;
+    return addStep(std::move(S));
+  }
+
+  // Steps carry no wrap or fast-math flags unless a rule proves they hold
+  // for the new expression; dropping them is always correct
+  void setNoWrapFlags(Ref R, bool NUW, bool NSW) {
+    Steps[R.getStep()].HasNUW = NUW;
+    Steps[R.getStep()].HasNSW = NSW;
+  }
+
+  void setFastMathFlags(Ref R, FastMathFlags FMF) {
+    Steps[R.getStep()].FMF = FMF;
+  }
+
+  void setResult(Ref R) { Result = R; }
+  Ref getResult() const { return Result; }
+  const SmallVectorImpl<Step> &steps() const { return Steps; }
+
+  Type *getType(Ref R) const {
+    return R.isStep() ? Steps[R.getStep()].Ty : R.getValue()->getType();
+  }
+
+  // Create the planned instructions in front of InsertPt and return the
+  // value that replaces it. The new instructions are added to NewInsts
+  Value *materialize(Instruction *InsertPt,
+                     SmallVectorImpl<Instruction *> &NewInsts) const {
+    // Nothing can be inserted among the PHIs at the top of a block
+    IRBuilder<> Builder(isa<PHINode>(InsertPt)
+                            ? &*InsertPt->getParent()->getFirstInsertionPt()
+                            : InsertPt);
+    SmallVector<Value *, 4> Built;
+    auto resolve = [&](Ref R) {
+      return R.isStep() ? Built[R.getStep()] : R.getValue();
+    };
+    for (const Step &S : Steps) {
+      if (Instruction::isCast(S.Opcode))
+        Built.push_back(Builder.CreateCast(
+            static_cast<Instruction::CastOps>(S.Opcode), resolve(S.Ops[0]),
+            S.Ty));
+      else if (S.Opcode == Instruction::ICmp)
+        Built.push_back(
+            Builder.CreateICmp(S.Pred, resolve(S.Ops[0]), resolve(S.Ops[1])));
+      else if (S.Opcode == Instruction::Select)
+        Built.push_back(Builder.CreateSelect(
+            resolve(S.Ops[0]), resolve(S.Ops[1]), resolve(S.Ops[2])));
+      else if (S.Opcode == Instruction::Call)
+        Built.push_back(Builder.CreateIntrinsic(
+            S.IID, {S.Ty}, to_vector<3>(map_range(S.Ops, resolve))));
+      else
+        Built.push_back(
+            Builder.CreateBinOp(static_cast<Instruction::BinaryOps>(S.Opcode),
+                                resolve(S.Ops[0]), resolve(S.Ops[1])));
+      if (auto *BO = dyn_cast<BinaryOperator>(Built.back())) {
+        if (S.HasNUW)
+          BO->setHasNoUnsignedWrap();
+        if (S.HasNSW)
+          BO->setHasNoSignedWrap();
+        if (isa<FPMathOperator>(BO))
+          BO->setFastMathFlags(S.FMF);
+      }
+      if (auto *NewI = dyn_cast<Instruction>(Built.back()))
+        NewInsts.push_back(NewI);
+    }
+    return resolve(Result);
+  }
+
+private:
+  SmallVector<Step, 8> Steps;
+  Ref Result = nullptr;
+
+  Ref addStep(Step S) {
+    Steps.push_back(std::move(S));
+    return Ref::step(Steps.size() - 1);
+  }
+};
+
+class TransformationVerifier {
+private:
+  using Ref = RewritePlan::Ref;
+
+  // Analyses are only requested by the checks that need them and cached for
+  // the function being run on; see reset()
+  Function *F = nullptr;
+  FunctionAnalysisManager *FAM = nullptr;
+  DominatorTree *DT = nullptr;
+  ScalarEvolution *SE = nullptr;
+
+  DominatorTree &getDT() {
+    if (!DT)
+      DT = &FAM->getResult<DominatorTreeAnalysis>(*F);
+    return *DT;
+  }
+
+  ScalarEvolution &getSE() {
+    if (!SE)
+      SE = &FAM->getResult<ScalarEvolutionAnalysis>(*F);
+    return *SE;
+  }
+
+  // Verify type compatibility
+  bool verifyTypes(Instruction *Original, const RewritePlan &Plan) {
+    Ref Result = Plan.getResult();
+    if (!Result.isStep() && !Result.getValue())
+      return false;
+    return Original->getType() == Plan.getType(Result);
+  }
+
+  // Verify control flow preservation. Planned steps are plain arithmetic that
+  // neither terminates a block nor has side effects, so the original must not
+  // either
+  bool verifyControlFlow(Instruction *Original) {
+    return !Original->isTerminator() && !Original->mayHaveSideEffects();
+  }
+
+  // Verify memory access patterns. Planned steps never access memory, and
+  // dropping an access of the original is not something a plan can express
+  bool verifyMemoryAccess(Instruction *Original) {
+    return !Original->mayReadOrWriteMemory();
+  }
+
+  // Whether Def is reachable from I through a short chain of non-PHI
+  // operands, in which case it dominates I without consulting the DomTree
+  static bool isInOperandTree(Value *Def, Instruction *I, unsigned Depth) {
+    if (isa<PHINode>(I))
+      return false;
+    for (Value *Op : I->operands()) {
+      if (Op == Def)
+        return true;
+      if (auto *OpI = dyn_cast<Instruction>(Op))
+        if (Depth > 1 && isInOperandTree(Def, OpI, Depth - 1))
+          return true;
+    }
+    return false;
+  }
+
+  // Verify data dependencies: every existing instruction the plan reads must
+  // already be available where the original is
+  bool verifyDataDependencies(Instruction *Original, const RewritePlan &Plan) {
+    auto isAvailable = [&](Ref R) {
+      auto *Def = dyn_cast_or_null<Instruction>(R.getValue());
+      if (!Def)
+        return true;
+      if (Def == Original)
+        return false;
+      if (Def->getParent() == Original->getParent() && !isa<PHINode>(Original))
+        return Def->comesBefore(Original);
+      return isInOperandTree(Def, Original, 3) ||
+             getDT().dominates(Def, Original);
+    };
+
+    if (!isAvailable(Plan.getResult()))
+      return false;
+    for (const auto &S : Plan.steps())
+      if (!all_of(S.Ops, isAvailable))
+        return false;
+    return true;
+  }
+
+  // SCEV of the plan's result, or null when a step is outside what SCEV can
+  // model exactly
+  const SCEV *getPlanSCEV(const RewritePlan &Plan) {
+    ScalarEvolution &SE = getSE();
+    SmallVector<const SCEV *, 4> StepSCEVs;
+    auto getSCEV = [&](Ref R) -> const SCEV * {
+      if (R.isStep())
+        return StepSCEVs[R.getStep()];
+      return SE.isSCEVable(R.getValue()->getType()) ? SE.getSCEV(R.getValue())
+                                                    : nullptr;
+    };
+
+    for (const auto &S : Plan.steps()) {
+      const SCEV *Result = nullptr;
+      if (!Instruction::isBinaryOp(S.Opcode)) {
+        StepSCEVs.push_back(Result);
+        continue;
+      }
+      const SCEV *LHS = getSCEV(S.Ops[0]), *RHS = getSCEV(S.Ops[1]);
+      auto *ShAmt = dyn_cast_or_null<SCEVConstant>(RHS);
+      if (LHS && RHS) {
+        switch (S.Opcode) {
+        case Instruction::Add:
+          Result = SE.getAddExpr(LHS, RHS);
+          break;
+        case Instruction::Sub:
+          Result = SE.getMinusSCEV(LHS, RHS);
+          break;
+        case Instruction::Mul:
+          Result = SE.getMulExpr(LHS, RHS);
+          break;
+        case Instruction::UDiv:
+          Result = SE.getUDivExpr(LHS, RHS);
+          break;
+        case Instruction::Shl:
+          if (ShAmt && ShAmt->getAPInt().ult(S.Ty->getScalarSizeInBits()))
+            Result = SE.getMulExpr(
+                LHS, SE.getConstant(APInt::getOneBitSet(
+                         S.Ty->getScalarSizeInBits(),
+                         ShAmt->getAPInt().getZExtValue())));
+          break;
+        case Instruction::LShr:
+          if (ShAmt && ShAmt->getAPInt().ult(S.Ty->getScalarSizeInBits()))
+            Result = SE.getUDivExpr(
+                LHS, SE.getConstant(APInt::getOneBitSet(
+                         S.Ty->getScalarSizeInBits(),
+                         ShAmt->getAPInt().getZExtValue())));
+          break;
+        default:
+          break;
+        }
+      }
+      StepSCEVs.push_back(Result);
+    }
+    return getSCEV(Plan.getResult());
+  }
+
+  // Whether S is a polynomial over opaque values, the fragment in which
+  // SCEV's normal form is canonical. Elsewhere, e.g. under a udiv or a
+  // zext of a trunc, equal values can have different expressions
+  static bool isPolynomial(const SCEV *S) {
+    return !SCEVExprContains(S, [](const SCEV *Op) {
+      return !isa<SCEVAddExpr, SCEVMulExpr, SCEVAddRecExpr, SCEVConstant,
+                  SCEVUnknown>(Op);
+    });
+  }
+
+  // Verify arithmetic properties. When SCEV models both sides as
+  // polynomials, their expressions must be identical; otherwise SCEV has
+  // nothing to say
+  bool verifyArithmetic(Instruction *Original, const RewritePlan &Plan) {
+    // Only verify integer arithmetic instructions, the only ones SCEV models
+    if (!Original->isBinaryOp() || !Original->getType()->isIntegerTy())
+      return true;
+
+    const SCEV *OriginalSCEV = getSE().getSCEV(Original);
+    if (isa<SCEVUnknown>(OriginalSCEV) || !isPolynomial(OriginalSCEV))
+      return true;
+
+    const SCEV *TransformedSCEV = getPlanSCEV(Plan);
+    return !TransformedSCEV || OriginalSCEV == TransformedSCEV;
+  }
+
+  // Verify exception behavior. Planned steps never throw
+  bool verifyExceptions(Instruction *Original) { return !Original->mayThrow(); }
+
+public:
+  // Start verifying rewrites in F, dropping the analyses cached for the
+  // previous function
+  void reset(Function &F, FunctionAnalysisManager &FAM) {
+    this->F = &F;
+    this->FAM = &FAM;
+    DT = nullptr;
+    SE = nullptr;
+  }
+
+  bool verify(Instruction *Original, const RewritePlan &Plan) {
+    // Run all verification checks
+    if (!verifyTypes(Original, Plan))
+      return false;
+
+    if (!verifyControlFlow(Original))
+      return false;
+
+    if (!verifyMemoryAccess(Original))
+      return false;
+
+    if (!verifyDataDependencies(Original, Plan))
+      return false;
+
+    if (!verifyArithmetic(Original, Plan))
+      return false;
+
+    if (!verifyExceptions(Original))
+      return false;
+
+    return true;
+  }
+};
+
+static cl::opt<TargetTransformInfo::TargetCostKind> PeepHoleCostKind(
+    "peephole-cost-kind", cl::init(TargetTransformInfo::TCK_RecipThroughput),
+    cl::desc("Target cost kind used to decide whether a rewrite pays off"),
+    cl::values(clEnumValN(TargetTransformInfo::TCK_RecipThroughput,
+                          "throughput", "Reciprocal throughput"),
+               clEnumValN(TargetTransformInfo::TCK_Latency, "latency",
+                          "Instruction latency"),
+               clEnumValN(TargetTransformInfo::TCK_CodeSize, "code-size",
+                          "Code size"),
+               clEnumValN(TargetTransformInfo::TCK_SizeAndLatency,
+                          "size-latency", "Code size and latency")));
+
+static cl::opt<unsigned> PeepHoleSelectThreshold(
+    "peephole-select-threshold", cl::init(4),
+    cl::desc("Cost, in basic instructions, a branch may be replaced with when "
+             "converting it to selects"));
+
+static cl::opt<unsigned> PeepHoleDivideCost(
+    "peephole-divide-cost", cl::init(20),
+    cl::desc("Least cost, in basic instructions, of a scalar hardware divide "
+             "or remainder when optimizing for speed"));
+
+// Prices a rewrite with the target's TargetTransformInfo. The plan is costed
+// step by step before anything is built, and compared with the instructions
+// it replaces: the original instruction plus the operands that die with it.
+class CostModel {
+private:
+  const TargetTransformInfo *TTI = nullptr;
+  TargetTransformInfo::TargetCostKind CostKind = PeepHoleCostKind;
+
+  // Upper bound on the dying operands accounted to one rewrite
+  static constexpr unsigned MaxDyingOperands = 64;
+
+  struct Estimate {
+    InstructionCost Cost = 0;
+    // Instructions the target does not get for free; e.g. a zext that is a
+    // subregister read costs nothing and does not count
+    unsigned NumInsts = 0;
+
+    void add(InstructionCost C) {
+      Cost += C;
+      if (C != 0)
+        NumInsts++;
+    }
+  };
+
+  InstructionCost getStepCost(const RewritePlan &Plan,
+                              const RewritePlan::Step &S) const {
+    if (Instruction::isCast(S.Opcode))
+      return TTI->getCastInstrCost(S.Opcode, S.Ty, Plan.getType(S.Ops[0]),
+                                   TargetTransformInfo::CastContextHint::None,
+                                   CostKind);
+    if (S.Opcode == Instruction::ICmp)
+      return TTI->getCmpSelInstrCost(S.Opcode, Plan.getType(S.Ops[0]), S.Ty,
+                                     S.Pred, CostKind);
+    if (S.Opcode == Instruction::Select)
+      return TTI->getCmpSelInstrCost(S.Opcode, S.Ty, Plan.getType(S.Ops[0]),
+                                     CmpInst::BAD_ICMP_PREDICATE, CostKind);
+    if (S.Opcode == Instruction::Call) {
+      SmallVector<Type *, 3> ArgTys;
+      for (RewritePlan::Ref Op : S.Ops)
+        ArgTys.push_back(Plan.getType(Op));
+      return TTI->getIntrinsicInstrCost(
+          IntrinsicCostAttributes(S.IID, S.Ty, ArgTys), CostKind);
+    }
+
+    InstructionCost DivideCost = getDivideCost(S.Opcode, S.Ty);
+    if (DivideCost.isValid())
+      return DivideCost;
+
+    // Constant operands select the cheaper lowerings, e.g. a shift by a
+    // uniform amount or a division by a power of two
+    TargetTransformInfo::OperandValueKind Kinds[2] = {
+        TargetTransformInfo::OK_AnyValue, TargetTransformInfo::OK_AnyValue};
+    TargetTransformInfo::OperandValueProperties Props[2] = {
+        TargetTransformInfo::OP_None, TargetTransformInfo::OP_None};
+    for (unsigned Idx = 0; Idx < 2; ++Idx)
+      if (!S.Ops[Idx].isStep())
+        Kinds[Idx] = TargetTransformInfo::getOperandInfo(
+            S.Ops[Idx].getValue(), Props[Idx]);
+    return TTI->getArithmeticInstrCost(S.Opcode, S.Ty, CostKind, Kinds[0],
+                                       Kinds[1], Props[0], Props[1]);
+  }
+
+  // I's operands that lose their last use when I goes away and are not
+  // reused by the plan, transitively. The walk is bounded by a budget rather
+  // than a depth so that a whole associative tree is accounted for
+  void addDyingOperands(Instruction *I, const SmallPtrSetImpl<Value *> &Reused,
+                        Estimate &E) const {
+    SmallVector<Instruction *, 8> Stack{I};
+    unsigned Budget = MaxDyingOperands;
+    while (!Stack.empty()) {
+      for (Value *Op : Stack.pop_back_val()->operands()) {
+        auto *OpI = dyn_cast<Instruction>(Op);
+        if (!OpI || !OpI->hasOneUse() || Reused.count(OpI) ||
+            !wouldInstructionBeTriviallyDead(OpI))
+          continue;
+        E.add(TTI->getInstructionCost(OpI, CostKind));
+        if (!--Budget)
+          return;
+        Stack.push_back(OpI);
+      }
+    }
+  }
+
+  // A scalar division or remainder is priced as the hardware divide,
+  // whatever its divisor, and for speed no lower than -peephole-divide-cost:
+  // X86 prices a divide like an add, so the multiply sequences of rules
+  // 16-19 could never pay off. Returns an invalid cost for anything else
+  InstructionCost getDivideCost(unsigned Opcode, Type *Ty) const {
+    if (!Ty->isIntegerTy() ||
+        (Opcode != Instruction::UDiv && Opcode != Instruction::SDiv &&
+         Opcode != Instruction::URem && Opcode != Instruction::SRem))
+      return InstructionCost::getInvalid();
+    InstructionCost Cost = TTI->getArithmeticInstrCost(Opcode, Ty, CostKind);
+    if (CostKind == TargetTransformInfo::TCK_CodeSize)
+      return Cost;
+    return std::max(Cost, InstructionCost(PeepHoleDivideCost *
+                                          TargetTransformInfo::TCC_Basic));
+  }
+
+  // What I costs as the instruction a plan replaces
+  InstructionCost getReplacedCost(Instruction *I) const {
+    InstructionCost Cost = getDivideCost(I->getOpcode(), I->getType());
+    return Cost.isValid() ? Cost : TTI->getInstructionCost(I, CostKind);
+  }
+
+public:
+  void reset(Function &F, FunctionAnalysisManager &FAM) {
+    TTI = &FAM.getResult<TargetIRAnalysis>(F);
+  }
+
+  InstructionCost getInstructionCost(const Instruction *I) const {
+    return TTI->getInstructionCost(I, CostKind);
+  }
+
+  InstructionCost getSelectCost(Type *Ty, Type *CondTy) const {
+    return TTI->getCmpSelInstrCost(Instruction::Select, Ty, CondTy,
+                                   CmpInst::BAD_ICMP_PREDICATE, CostKind);
+  }
+
+  InstructionCost getIntrinsicCost(Intrinsic::ID IID, Type *Ty) const {
+    return TTI->getIntrinsicInstrCost(IntrinsicCostAttributes(IID, Ty, {Ty}),
+                                      CostKind);
+  }
+
+  // Most a branch may be replaced with when converting it to selects
+  InstructionCost getSelectBudget() const {
+    return PeepHoleSelectThreshold * TargetTransformInfo::TCC_Basic;
+  }
+
+  // Whether the profile says BI almost always goes the same way, in which
+  // case the predictor gets it right and the branch is cheaper than any
+  // select. Without a profile every branch is taken to be unpredictable
+  bool isPredictable(const BranchInst *BI) const {
+    uint64_t TrueWeight, FalseWeight;
+    if (!BI->extractProfMetadata(TrueWeight, FalseWeight) ||
+        TrueWeight + FalseWeight == 0)
+      return false;
+    BranchProbability Likely = BranchProbability::getBranchProbability(
+        std::max(TrueWeight, FalseWeight), TrueWeight + FalseWeight);
+    return Likely > TTI->getPredictableBranchThreshold();
+  }
+
+  // A plan pays off when it is cheaper than what it replaces, or as cheap
+  // without adding instructions, which keeps canonicalizations such as
+  // mul by 2^k into shl. Delta receives the cost difference
+  bool isProfitable(Instruction *I, const RewritePlan &Plan,
+                    int &Delta) const {
+    SmallPtrSet<Value *, 8> Reused;
+    Estimate New, Old;
+    auto reuse = [&](RewritePlan::Ref R) {
+      if (!R.isStep())
+        Reused.insert(R.getValue());
+    };
+    auto isConstant = [](RewritePlan::Ref R) {
+      return !R.isStep() && isa<Constant>(R.getValue());
+    };
+    reuse(Plan.getResult());
+    for (const auto &S : Plan.steps()) {
+      // Steps on constants only are folded away when materialized, except
+      // for intrinsic calls
+      if (S.Opcode != Instruction::Call && all_of(S.Ops, isConstant))
+        continue;
+      New.add(getStepCost(Plan, S));
+      for_each(S.Ops, reuse);
+    }
+    Old.add(getReplacedCost(I));
+    addDyingOperands(I, Reused, Old);
+
+    InstructionCost Diff = New.Cost - Old.Cost;
+    if (!Diff.isValid())
+      return false;
+    Delta = *Diff.getValue();
+    return Delta < 0 || (Delta == 0 && New.NumInsts <= Old.NumInsts);
+  }
+};
+
+// What rules may consult beyond the instruction they match. Analyses are
+// fetched lazily and cached for the function being run on, like the
+// verifier's; see reset()
+class RuleContext {
+private:
+  Function *F = nullptr;
+  FunctionAnalysisManager *FAM = nullptr;
+  const CostModel *Costs = nullptr;
+  DominatorTree *DT = nullptr;
+  AssumptionCache *AC = nullptr;
+  LazyValueInfo *LVI = nullptr;
+
+  // Upper bound on the chain of users walked for demanded bits
+  static constexpr unsigned MaxDemandedDepth = 4;
+
+  // Bits of U's value that its user can observe
+  APInt getDemandedByUse(const Use &U, unsigned Depth) {
+    auto *UserI = cast<Instruction>(U.getUser());
+    unsigned BW = U->getType()->getScalarSizeInBits();
+    unsigned OpNo = U.getOperandNo();
+    const APInt *C;
+    auto getUserDemanded = [&]() { return getDemandedBits(UserI, Depth + 1); };
+    switch (UserI->getOpcode()) {
+    case Instruction::Trunc:
+      return APInt::getLowBitsSet(BW, UserI->getType()->getScalarSizeInBits());
+    case Instruction::ZExt:
+      return getUserDemanded().trunc(BW);
+    case Instruction::SExt: {
+      APInt Demanded = getUserDemanded();
+      APInt Low = Demanded.trunc(BW);
+      if (Demanded.getActiveBits() > BW)
+        Low.setSignBit();
+      return Low;
+    }
+    case Instruction::And:
+      if (match(UserI->getOperand(1 - OpNo), m_APInt(C)))
+        return getUserDemanded() & *C;
+      return getUserDemanded();
+    case Instruction::Or:
+      if (match(UserI->getOperand(1 - OpNo), m_APInt(C)))
+        return getUserDemanded() & ~*C;
+      return getUserDemanded();
+    case Instruction::Xor:
+      return getUserDemanded();
+    // Carries only move towards the high bits
+    case Instruction::Add:
+    case Instruction::Sub:
+    case Instruction::Mul:
+      return APInt::getLowBitsSet(BW, getUserDemanded().getActiveBits());
+    case Instruction::Shl:
+      if (OpNo == 0 && match(UserI->getOperand(1), m_APInt(C)) && C->ult(BW))
+        return getUserDemanded().lshr(*C);
+      break;
+    case Instruction::LShr:
+      if (OpNo == 0 && match(UserI->getOperand(1), m_APInt(C)) && C->ult(BW))
+        return getUserDemanded().shl(*C);
+      break;
+    case Instruction::AShr:
+      if (OpNo == 0 && match(UserI->getOperand(1), m_APInt(C)) && C->ult(BW)) {
+        APInt Demanded = getUserDemanded();
+        APInt Shifted = Demanded.shl(*C);
+        // The top bits of the result are copies of the sign bit
+        if (Demanded.countLeadingZeros() < C->getZExtValue())
+          Shifted.setSignBit();
+        return Shifted;
+      }
+      break;
+    case Instruction::Select:
+      if (OpNo != 0)
+        return getUserDemanded();
+      break;
+    default:
+      break;
+    }
+    return APInt::getAllOnes(BW);
+  }
+
+public:
+  void reset(Function &F, FunctionAnalysisManager &FAM,
+             const CostModel &Costs) {
+    this->F = &F;
+    this->FAM = &FAM;
+    this->Costs = &Costs;
+    DT = nullptr;
+    AC = nullptr;
+    LVI = nullptr;
+  }
+
+  // For rules that choose between several candidate plans
+  bool isProfitable(Instruction *I, const RewritePlan &Plan) const {
+    int Delta;
+    return Costs->isProfitable(I, Plan, Delta);
+  }
+
+  const DataLayout &getDataLayout() const {
+    return F->getParent()->getDataLayout();
+  }
+
+  DominatorTree &getDT() {
+    if (!DT)
+      DT = &FAM->getResult<DominatorTreeAnalysis>(*F);
+    return *DT;
+  }
+
+  AssumptionCache &getAC() {
+    if (!AC)
+      AC = &FAM->getResult<AssumptionAnalysis>(*F);
+    return *AC;
+  }
+
+  LazyValueInfo &getLVI() {
+    if (!LVI)
+      LVI = &FAM->getResult<LazyValueAnalysis>(*F);
+    return *LVI;
+  }
+
+  // Range of the scalar integer V wherever CxtI executes. Rewrites only ever
+  // replace values with equal ones, so ranges LVI has cached stay valid
+  ConstantRange getRange(Value *V, Instruction *CxtI) {
+    return getLVI().getConstantRange(V, CxtI, /*UndefAllowed=*/false);
+  }
+
+  // Integer widths narrower than BW that the target handles natively,
+  // narrowest first
+  SmallVector<unsigned, 4> getLegalWidthsBelow(unsigned BW) const {
+    SmallVector<unsigned, 4> Widths;
+    for (unsigned Width : {8u, 16u, 32u})
+      if (Width < BW && getDataLayout().isLegalInteger(Width))
+        Widths.push_back(Width);
+    return Widths;
+  }
+
+  KnownBits computeKnownBits(Value *V, Instruction *CxtI) {
+    return llvm::computeKnownBits(V, getDataLayout(), 0, &getAC(), CxtI,
+                                  &getDT());
+  }
+
+  // Bits of I that its users can observe, from a bounded walk over the
+  // users. Unlike DemandedBitsAnalysis this looks at the current IR, so it
+  // cannot go stale while the pass rewrites the function
+  APInt getDemandedBits(Instruction *I, unsigned Depth = 0) {
+    unsigned BW = I->getType()->getScalarSizeInBits();
+    if (Depth == MaxDemandedDepth)
+      return APInt::getAllOnes(BW);
+    APInt Demanded(BW, 0);
+    for (const Use &U : I->uses()) {
+      Demanded |= getDemandedByUse(U, Depth);
+      if (Demanded.isAllOnes())
+        break;
+    }
+    return Demanded;
+  }
+};
+
+// Peephole rules are compile-time descriptors: each one names the opcodes it
+// applies to and matches with llvm::PatternMatch, and RuleSet stitches them
+// into a single statically dispatched matcher. The rule set is a type, so it
+// is shared by every pass instance and never rebuilt at run time. A rule only
+// describes its replacement in a RewritePlan and never touches the IR itself.
+// Rules that need analyses take the RuleContext as a third parameter.
+template <unsigned... Opcodes> struct RuleBase {
+  static constexpr bool appliesTo(unsigned Opcode) {
+    return ((Opcode == Opcodes) || ...);
+  }
+};
+
+// Tries Rules in order on an instruction and hands each plan to a commit
+// callback, stopping at the first one the callback accepts. The opcode
+// switch is generated from Instruction.def and every case only instantiates
+// the rules for that opcode, so e.g. a load or a call costs no matcher
+// invocation at all.
+template <typename... Rules> struct RuleSet {
+  template <typename CommitFn>
+  static bool apply(Instruction *I, RuleContext &Ctx, CommitFn &&Commit) {
+    switch (I->getOpcode()) {
+#define HANDLE_INST(N, OPC, CLASS)                                             \
+  case Instruction::OPC:                                                       \
+    return applyFor<Instruction::OPC>(I, Ctx, Commit);
+#include "llvm/IR/Instruction.def"
+    default:
+      return false;
+    }
+  }
+
+private:
+  template <unsigned Opcode, typename CommitFn>
+  static bool applyFor(Instruction *I, RuleContext &Ctx, CommitFn &Commit) {
+    return (tryRule<Opcode, Rules>(I, Ctx, Commit) || ...);
+  }
+
+  template <unsigned Opcode, typename Rule, typename CommitFn>
+  static bool tryRule(Instruction *I, RuleContext &Ctx, CommitFn &Commit) {
+    if constexpr (Rule::appliesTo(Opcode)) {
+      RewritePlan Plan;
+      bool Matched;
+      if constexpr (std::is_invocable_v<decltype(&Rule::apply), Instruction *,
+                                        RewritePlan &, RuleContext &>)
+        Matched = Rule::apply(I, Plan, Ctx);
+      else
+        Matched = Rule::apply(I, Plan);
+      if (Matched)
+        return Commit(Plan);
+    }
+    return false;
+  }
+};
+
+// X op C -> X, where C is the identity element matched by IdentityT
+template <unsigned Opcode, typename IdentityT, bool Commutable>
+struct IdentityRule : RuleBase<Opcode> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *X;
+    if (!match(I, BinaryOp_match<bind_ty<Value>, IdentityT, Opcode, Commutable>(
+                      m_Value(X), IdentityT())))
+      return false;
+    Plan.setResult(X);
+    return true;
+  }
+};
+
+// X op X -> X
+template <unsigned Opcode> struct IdempotentRule : RuleBase<Opcode> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *X = nullptr;
+    if (!match(I, BinaryOp_match<bind_ty<Value>, deferredval_ty<Value>, Opcode>(
+                      m_Value(X), m_Deferred(X))))
+      return false;
+    Plan.setResult(X);
+    return true;
+  }
+};
+
+// 1. Multiply by power of 2 -> Shift left
+struct MulPow2ToShl : RuleBase<Instruction::Mul> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *X;
+    const APInt *C;
+    if (!match(I, m_Mul(m_Value(X), m_Power2(C))))
+      return false;
+    Plan.setResult(Plan.binOp(Instruction::Shl, X,
+                              ConstantInt::get(I->getType(), C->logBase2())));
+    return true;
+  }
+};
+
+// 2. Division by power of 2 -> Shift right
+struct UDivPow2ToLShr : RuleBase<Instruction::UDiv> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *X;
+    const APInt *C;
+    if (!match(I, m_UDiv(m_Value(X), m_Power2(C))))
+      return false;
+    Plan.setResult(Plan.binOp(Instruction::LShr, X,
+                              ConstantInt::get(I->getType(), C->logBase2())));
+    return true;
+  }
+};
+
+// 3. Add zero elimination
+using AddZero = IdentityRule<Instruction::Add, cst_pred_ty<is_zero_int>, true>;
+
+// 4. Multiply by zero -> zero
+struct MulZero : RuleBase<Instruction::Mul> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    if (!match(I, m_c_Mul(m_Value(), m_ZeroInt())))
+      return false;
+    Plan.setResult(Constant::getNullValue(I->getType()));
+    return true;
+  }
+};
+
+// 5. XOR with self -> zero
+struct XorSelf : RuleBase<Instruction::Xor> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *X = nullptr;
+    if (!match(I, m_Xor(m_Value(X), m_Deferred(X))))
+      return false;
+    Plan.setResult(Constant::getNullValue(I->getType()));
+    return true;
+  }
+};
+
+// 6. AND with self -> self
+using AndSelf = IdempotentRule<Instruction::And>;
+
+// 7. OR with self -> self
+using OrSelf = IdempotentRule<Instruction::Or>;
+
+// 8. NOT NOT -> original
+struct NotNot : RuleBase<Instruction::Xor> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *X;
+    if (!match(I, m_Not(m_Not(m_Value(X)))))
+      return false;
+    Plan.setResult(X);
+    return true;
+  }
+};
+
+// 9. AND with all ones -> self
+using AndAllOnes =
+    IdentityRule<Instruction::And, cst_pred_ty<is_all_ones>, true>;
+
+// 10. OR with zero -> self
+using OrZero = IdentityRule<Instruction::Or, cst_pred_ty<is_zero_int>, true>;
+
+// 11. Constant Propagation
+struct ConstantPropagation
+    : RuleBase<Instruction::Add, Instruction::Sub, Instruction::Mul,
+               Instruction::UDiv, Instruction::SDiv> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    const APInt *C1P, *C2P;
+    if (!match(I, m_BinOp(m_APInt(C1P), m_APInt(C2P))))
+      return false;
+    // ConstantInt::get splats the folded value again for vector types
+    const APInt &C1 = *C1P, &C2 = *C2P;
+    switch (I->getOpcode()) {
+    case Instruction::Add:
+      Plan.setResult(ConstantInt::get(I->getType(), C1 + C2));
+      return true;
+    case Instruction::Sub:
+      Plan.setResult(ConstantInt::get(I->getType(), C1 - C2));
+      return true;
+    case Instruction::Mul:
+      Plan.setResult(ConstantInt::get(I->getType(), C1 * C2));
+      return true;
+    // Division by zero is immediate UB, leave it alone rather than fold it
+    case Instruction::UDiv:
+      if (C2.isZero())
+        return false;
+      Plan.setResult(ConstantInt::get(I->getType(), C1.udiv(C2)));
+      return true;
+    case Instruction::SDiv:
+      if (C2.isZero())
+        return false;
+      Plan.setResult(ConstantInt::get(I->getType(), C1.sdiv(C2)));
+      return true;
+    default:
+      return false;
+    }
+  }
+};
+
+// 12. Subtract zero elimination
+using SubZero = IdentityRule<Instruction::Sub, cst_pred_ty<is_zero_int>, false>;
+
+// 13. Negate zero
+struct NegateZero : RuleBase<Instruction::FNeg> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Constant *C;
+    if (!match(I, m_FNeg(m_Constant(C))) || !match(C, m_AnyZeroFP()))
+      return false;
+    Plan.setResult(ConstantExpr::getFNeg(C));
+    return true;
+  }
+};
+
+// 14. Multiply by one
+using MulOne = IdentityRule<Instruction::Mul, cst_pred_ty<is_one>, true>;
+
+// 15. Divide by one
+using UDivOne = IdentityRule<Instruction::UDiv, cst_pred_ty<is_one>, false>;
+using SDivOne = IdentityRule<Instruction::SDiv, cst_pred_ty<is_one>, false>;
+
+// Division and remainder by a constant lowered to a multiply-high and
+// shifts, with the Granlund-Montgomery magic numbers (Hacker's Delight,
+// chapter 10) that TargetLowering::BuildUDIV and BuildSDIV use as well
+struct ConstantDivision {
+  using Ref = RewritePlan::Ref;
+
+  // The multiply-high is done in twice the width. Keep that to types the
+  // backend lowers to a single widening multiply
+  static bool canWiden(Type *Ty) {
+    unsigned BW = Ty->getScalarSizeInBits();
+    return Ty->isVectorTy() ? BW <= 32 : BW <= 64;
+  }
+
+  // High half of X * M: trunc((ext X * ext M) >> BW)
+  static Ref mulHigh(RewritePlan &Plan, Ref X, const APInt &M, bool Signed) {
+    Type *Ty = Plan.getType(X);
+    unsigned BW = M.getBitWidth();
+    Type *WideTy = Ty->getWithNewBitWidth(2 * BW);
+    Ref WideX = Plan.cast(Signed ? Instruction::SExt : Instruction::ZExt, X,
+                          WideTy);
+    Ref Product = Plan.binOp(
+        Instruction::Mul, WideX,
+        ConstantInt::get(WideTy, Signed ? M.sext(2 * BW) : M.zext(2 * BW)));
+    Plan.setNoWrapFlags(Product, !Signed, Signed);
+    Ref High = Plan.binOp(Instruction::LShr, Product,
+                          ConstantInt::get(WideTy, BW));
+    return Plan.cast(Instruction::Trunc, High, Ty);
+  }
+
+  // X /u D for D that is neither 0, 1 nor a power of 2
+  static Ref udiv(RewritePlan &Plan, Ref X, const APInt &D) {
+    Type *Ty = Plan.getType(X);
+    auto Magic = UnsignedDivisonByConstantInfo::get(D);
+    // An even divisor can avoid the add fixup by shifting the dividend first
+    unsigned PreShift = 0;
+    if (Magic.IsAdd && !D[0]) {
+      PreShift = D.countTrailingZeros();
+      Magic = UnsignedDivisonByConstantInfo::get(D.lshr(PreShift), PreShift);
+    }
+
+    Ref Q = X;
+    if (PreShift)
+      Q = Plan.binOp(Instruction::LShr, Q, ConstantInt::get(Ty, PreShift));
+    Q = mulHigh(Plan, Q, Magic.Magic, /*Signed=*/false);
+    unsigned PostShift = Magic.ShiftAmount;
+    if (Magic.IsAdd) {
+      Ref NPQ = Plan.binOp(Instruction::Sub, X, Q);
+      NPQ = Plan.binOp(Instruction::LShr, NPQ, ConstantInt::get(Ty, 1));
+      Q = Plan.binOp(Instruction::Add, NPQ, Q);
+      PostShift--;
+    }
+    if (PostShift)
+      Q = Plan.binOp(Instruction::LShr, Q, ConstantInt::get(Ty, PostShift));
+    return Q;
+  }
+
+  // X /s D for D = 2^Log2 or -2^Log2: the arithmetic shift rounds towards
+  // negative infinity, so negative dividends are biased by 2^Log2 - 1 first
+  static Ref sdivPow2(RewritePlan &Plan, Ref X, unsigned Log2, bool Negate,
+                      bool Exact) {
+    Type *Ty = Plan.getType(X);
+    unsigned BW = Ty->getScalarSizeInBits();
+    Ref Q = X;
+    if (!Exact) {
+      Ref Sign = Plan.binOp(Instruction::AShr, X, ConstantInt::get(Ty, BW - 1));
+      Ref Bias =
+          Plan.binOp(Instruction::LShr, Sign, ConstantInt::get(Ty, BW - Log2));
+      Q = Plan.binOp(Instruction::Add, X, Bias);
+    }
+    Q = Plan.binOp(Instruction::AShr, Q, ConstantInt::get(Ty, Log2));
+    if (Negate)
+      Q = Plan.binOp(Instruction::Sub, Constant::getNullValue(Ty), Q);
+    return Q;
+  }
+
+  // X /s D for |D| that is neither 0, 1 nor a power of 2
+  static Ref sdiv(RewritePlan &Plan, Ref X, const APInt &D) {
+    Type *Ty = Plan.getType(X);
+    unsigned BW = Ty->getScalarSizeInBits();
+    auto Magic = SignedDivisionByConstantInfo::get(D);
+    Ref Q = mulHigh(Plan, X, Magic.Magic, /*Signed=*/true);
+    if (D.isStrictlyPositive() && Magic.Magic.isNegative())
+      Q = Plan.binOp(Instruction::Add, Q, X);
+    else if (D.isNegative() && Magic.Magic.isStrictlyPositive())
+      Q = Plan.binOp(Instruction::Sub, Q, X);
+    if (Magic.ShiftAmount)
+      Q = Plan.binOp(Instruction::AShr, Q,
+                     ConstantInt::get(Ty, Magic.ShiftAmount));
+    // Round towards zero by adding one to negative quotients
+    Ref Sign = Plan.binOp(Instruction::LShr, Q, ConstantInt::get(Ty, BW - 1));
+    return Plan.binOp(Instruction::Add, Q, Sign);
+  }
+};
+
+// The instruction with the given opcode, a division or a remainder, that
+// has the same operands as I and pairs up with it: the quotient dominates
+// the remainder, which can then be computed from it. See RemFromQuotient
+static BinaryOperator *findDivRemPartner(Instruction *I, unsigned Opcode,
+                                         RuleContext &Ctx) {
+  Value *X = I->getOperand(0), *Y = I->getOperand(1);
+  bool IsDiv = I->getOpcode() == Instruction::UDiv ||
+               I->getOpcode() == Instruction::SDiv;
+  for (User *U : X->users()) {
+    auto *Partner = dyn_cast<BinaryOperator>(U);
+    if (!Partner || Partner->getOpcode() != Opcode ||
+        Partner->getOperand(0) != X || Partner->getOperand(1) != Y)
+      continue;
+    if (IsDiv ? Ctx.getDT().dominates(I, Partner)
+              : Ctx.getDT().dominates(Partner, I))
+      return Partner;
+  }
+  return nullptr;
+}
+
+// 16. Unsigned division by constant -> multiply high and shifts. A
+// division whose remainder is taken as well is left alone until the
+// remainder has been rewritten to reuse it
+struct UDivByConstant : RuleBase<Instruction::UDiv> {
+  static bool apply(Instruction *I, RewritePlan &Plan, RuleContext &Ctx) {
+    Value *X;
+    const APInt *D;
+    if (!match(I, m_UDiv(m_Value(X), m_APInt(D))) || D->ule(1) ||
+        D->isPowerOf2() || !ConstantDivision::canWiden(I->getType()) ||
+        findDivRemPartner(I, Instruction::URem, Ctx))
+      return false;
+    Plan.setResult(ConstantDivision::udiv(Plan, X, *D));
+    return true;
+  }
+};
+
+// 17. Signed division by constant -> shifts with bias fixup for powers of 2,
+// multiply high and shifts otherwise. Left alone while its remainder is
+// taken as well, like the unsigned one
+struct SDivByConstant : RuleBase<Instruction::SDiv> {
+  static bool apply(Instruction *I, RewritePlan &Plan, RuleContext &Ctx) {
+    Value *X;
+    const APInt *D;
+    if (!match(I, m_SDiv(m_Value(X), m_APInt(D))) || D->isZero() ||
+        D->isOne())
+      return false;
+    // X / -1 -> 0 - X
+    if (D->isAllOnes()) {
+      Plan.setResult(Plan.binOp(Instruction::Sub,
+                                Constant::getNullValue(I->getType()), X));
+      return true;
+    }
+    if (findDivRemPartner(I, Instruction::SRem, Ctx))
+      return false;
+    APInt Abs = D->abs();
+    if (Abs.isPowerOf2()) {
+      Plan.setResult(ConstantDivision::sdivPow2(
+          Plan, X, Abs.logBase2(), D->isNegative(), I->isExact()));
+      return true;
+    }
+    if (!ConstantDivision::canWiden(I->getType()))
+      return false;
+    Plan.setResult(ConstantDivision::sdiv(Plan, X, *D));
+    return true;
+  }
+};
+
+// 18. Unsigned remainder by constant -> mask for powers of 2 (including 1),
+// X - (X / D) * D otherwise
+struct URemByConstant : RuleBase<Instruction::URem> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *X;
+    const APInt *D;
+    if (!match(I, m_URem(m_Value(X), m_APInt(D))) || D->isZero())
+      return false;
+    if (D->isPowerOf2()) {
+      Plan.setResult(Plan.binOp(Instruction::And, X,
+                                ConstantInt::get(I->getType(), *D - 1)));
+      return true;
+    }
+    if (!ConstantDivision::canWiden(I->getType()))
+      return false;
+    auto Q = ConstantDivision::udiv(Plan, X, *D);
+    auto QD =
+        Plan.binOp(Instruction::Mul, Q, ConstantInt::get(I->getType(), *D));
+    Plan.setResult(Plan.binOp(Instruction::Sub, X, QD));
+    return true;
+  }
+};
+
+// 19. Signed remainder by constant -> biased mask for powers of 2,
+// X - (X / D) * D otherwise
+struct SRemByConstant : RuleBase<Instruction::SRem> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *X;
+    const APInt *D;
+    if (!match(I, m_SRem(m_Value(X), m_APInt(D))) || D->isZero())
+      return false;
+    Type *Ty = I->getType();
+    unsigned BW = Ty->getScalarSizeInBits();
+    // The remainder takes the sign of the dividend, so only |D| matters
+    APInt Abs = D->abs();
+    if (Abs.isOne()) {
+      Plan.setResult(Constant::getNullValue(Ty));
+      return true;
+    }
+    if (Abs.isPowerOf2()) {
+      // X - ((X + Bias) & -2^Log2), Bias as in ConstantDivision::sdivPow2
+      unsigned Log2 = Abs.logBase2();
+      auto Sign =
+          Plan.binOp(Instruction::AShr, X, ConstantInt::get(Ty, BW - 1));
+      auto Bias =
+          Plan.binOp(Instruction::LShr, Sign, ConstantInt::get(Ty, BW - Log2));
+      auto Rounded = Plan.binOp(
+          Instruction::And, Plan.binOp(Instruction::Add, X, Bias),
+          ConstantInt::get(Ty, APInt::getHighBitsSet(BW, BW - Log2)));
+      Plan.setResult(Plan.binOp(Instruction::Sub, X, Rounded));
+      return true;
+    }
+    if (!ConstantDivision::canWiden(Ty))
+      return false;
+    auto Q = ConstantDivision::sdiv(Plan, X, *D);
+    auto QD = Plan.binOp(Instruction::Mul, Q, ConstantInt::get(Ty, *D));
+    Plan.setResult(Plan.binOp(Instruction::Sub, X, QD));
+    return true;
+  }
+};
+
+// 20. Multiply by constant -> shift/add/sub chain over the non-adjacent form
+// of the constant, e.g. x * 9 -> (x << 3) + x and x * 15 -> (x << 4) - x.
+// The cost model only lets the chain through where it beats the multiply
+struct MulByConstantToShiftAdd : RuleBase<Instruction::Mul> {
+  // Longer chains rarely beat a multiply, whatever the target
+  static constexpr unsigned MaxTerms = 3;
+
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *X;
+    const APInt *C;
+    if (!match(I, m_Mul(m_Value(X), m_APInt(C))) || C->isZero() ||
+        C->isOne() || C->isPowerOf2())
+      return false;
+
+    // C as a sum of +-2^Shift with no two adjacent digits set. It is computed
+    // one bit wider, the carry out of the top bit vanishes modulo 2^BW
+    unsigned BW = C->getBitWidth();
+    SmallVector<std::pair<unsigned, bool>, 4> Terms; // (Shift, IsNegative)
+    APInt Rest = C->zext(BW + 1);
+    for (unsigned Shift = 0; !Rest.isZero(); Shift++, Rest.lshrInPlace(1)) {
+      if (!Rest[0])
+        continue;
+      // Rest mod 4 == 3 takes a negative digit, which clears the run of ones
+      bool IsNegative = Rest[1];
+      if (IsNegative)
+        ++Rest;
+      else
+        --Rest;
+      if (Shift < BW)
+        Terms.push_back({Shift, IsNegative});
+      if (Terms.size() > MaxTerms)
+        return false;
+    }
+
+    Type *Ty = I->getType();
+    auto term = [&](unsigned Shift) -> RewritePlan::Ref {
+      if (!Shift)
+        return X;
+      return Plan.binOp(Instruction::Shl, X, ConstantInt::get(Ty, Shift));
+    };
+    // Start from the highest positive digit so the chain needs no negation
+    auto First =
+        find_if(reverse(Terms), [](const auto &T) { return !T.second; });
+    RewritePlan::Ref Acc = Constant::getNullValue(Ty);
+    if (First != Terms.rend())
+      Acc = term(First->first);
+    for (const auto &T : reverse(Terms)) {
+      if (First != Terms.rend() && &T == &*First)
+        continue;
+      Acc = Plan.binOp(T.second ? Instruction::Sub : Instruction::Add, Acc,
+                       term(T.first));
+    }
+    Plan.setResult(Acc);
+    return true;
+  }
+};
+
+// An associative and commutative expression flattened through its
+// single-use inner nodes, with its constant leaves kept apart. Integer add,
+// mul, and, or and xor qualify, and fadd and fmul when every node allows
+// reassociation. A shift left by a constant is a multiply by a power of two,
+// so shl chains left behind by rule 1 still join multiply trees
+struct AssociativeTree {
+  // Bounds the walk and, with it, the size of a rebuilt expression
+  static constexpr unsigned MaxLeaves = 32;
+  // Ranks saturate here, anything deeper counts as equally late
+  static constexpr unsigned MaxRank = 8;
+
+  unsigned Opcode = 0;
+  SmallVector<std::pair<unsigned, Value *>, 8> Leaves; // (Rank, Leaf)
+  SmallVector<Constant *, 4> Constants;
+  // Flags present on every node of the tree
+  bool AllNUW = true;
+  FastMathFlags FMF;
+  // Longest path from a leaf to the root, counting leaf ranks and one step
+  // per node
+  unsigned Height = 0;
+
+  // Constants and arguments rank lowest and every other value one above its
+  // highest ranked operand, which estimates when the value becomes
+  // available. PHIs and memory accesses start a new chain
+  static unsigned getRank(Value *V, unsigned Depth = 0) {
+    auto *I = dyn_cast<Instruction>(V);
+    if (!I)
+      return 0;
+    if (Depth == MaxRank || isa<PHINode>(I) || I->mayReadOrWriteMemory())
+      return MaxRank;
+    unsigned Rank = 0;
+    for (Value *Op : I->operands())
+      Rank = std::max(Rank, getRank(Op, Depth + 1));
+    return std::min(Rank + 1, MaxRank);
+  }
+
+  // The opcode V has as a tree node and, through Ops, its two operands
+  static unsigned getNode(Value *V, std::array<Value *, 2> &Ops) {
+    Value *X;
+    const APInt *ShAmt;
+    if (match(V, m_Shl(m_Value(X), m_APInt(ShAmt))) &&
+        ShAmt->ult(ShAmt->getBitWidth())) {
+      APInt Pow2 = APInt::getOneBitSet(ShAmt->getBitWidth(),
+                                       ShAmt->getZExtValue());
+      Ops = {X, ConstantInt::get(V->getType(), Pow2)};
+      return Instruction::Mul;
+    }
+    auto *BO = dyn_cast<BinaryOperator>(V);
+    if (!BO)
+      return 0;
+    unsigned Opcode = BO->getOpcode();
+    bool IsAssociative = Instruction::isAssociative(Opcode) &&
+                         Instruction::isCommutative(Opcode);
+    if ((Opcode == Instruction::FAdd || Opcode == Instruction::FMul) &&
+        BO->hasAllowReassoc())
+      IsAssociative = true;
+    if (!IsAssociative)
+      return 0;
+    Ops = {BO->getOperand(0), BO->getOperand(1)};
+    return Opcode;
+  }
+
+  // Whether I is absorbed into the tree of its only user
+  static bool isInnerNode(Instruction *I) {
+    std::array<Value *, 2> Ops;
+    unsigned Opcode = getNode(I, Ops);
+    return Opcode && I->hasOneUse() && getNode(I->user_back(), Ops) == Opcode;
+  }
+
+  // Flatten the tree rooted at Root, false if Root is not a tree node
+  bool build(Instruction *Root) {
+    std::array<Value *, 2> Ops;
+    Opcode = getNode(Root, Ops);
+    if (!Opcode)
+      return false;
+    FMF.set();
+    Height = collect(Root);
+    return true;
+  }
+
+  // Fold the constant leaves into one, or null if there are none
+  Constant *foldConstants() const {
+    if (Constants.empty())
+      return nullptr;
+    Constant *C = Constants.front();
+    for (Constant *Other : drop_begin(Constants))
+      C = ConstantExpr::get(Opcode, C, Other);
+    return C;
+  }
+
+  // Append a node combining LHS and RHS to Plan. Regrouping the operands of
+  // nuw adds keeps every partial sum below the total, which did not wrap;
+  // every other wrap flag may become wrong and is dropped
+  RewritePlan::Ref combine(RewritePlan &Plan, RewritePlan::Ref LHS,
+                           RewritePlan::Ref RHS) const {
+    // Keep constants on the right, as everywhere else in the IR
+    if (!LHS.isStep() && isa<Constant>(LHS.getValue()))
+      std::swap(LHS, RHS);
+    auto Node =
+        Plan.binOp(static_cast<Instruction::BinaryOps>(Opcode), LHS, RHS);
+    Plan.setNoWrapFlags(Node, Opcode == Instruction::Add && AllNUW, false);
+    if (Plan.getType(Node)->isFPOrFPVectorTy())
+      Plan.setFastMathFlags(Node, FMF);
+    return Node;
+  }
+
+private:
+  unsigned collect(Instruction *Node) {
+    std::array<Value *, 2> Ops;
+    getNode(Node, Ops);
+    if (isa<OverflowingBinaryOperator>(Node))
+      AllNUW &= Node->hasNoUnsignedWrap();
+    if (isa<FPMathOperator>(Node))
+      FMF &= Node->getFastMathFlags();
+
+    unsigned NodeHeight = 0;
+    for (Value *Op : Ops) {
+      std::array<Value *, 2> Unused;
+      auto *OpI = dyn_cast<Instruction>(Op);
+      if (OpI && OpI->hasOneUse() && getNode(OpI, Unused) == Opcode &&
+          Leaves.size() + Constants.size() < MaxLeaves) {
+        NodeHeight = std::max(NodeHeight, collect(OpI));
+      } else if (match(Op, m_ImmConstant())) {
+        Constants.push_back(cast<Constant>(Op));
+      } else {
+        unsigned Rank = getRank(Op);
+        Leaves.push_back({Rank, Op});
+        NodeHeight = std::max(NodeHeight, Rank);
+      }
+    }
+    return NodeHeight + 1;
+  }
+};
+
+// 21. Reassociate an associative and commutative tree and fold its constants
+// into one, e.g. ((x + 5) + 10) + 15 -> x + 30 and ((x * 2) * 4) * 8 -> x * 64.
+// Leaves are combined lowest rank first and the constant is applied last
+struct ReassociateConstants
+    : RuleBase<Instruction::Add, Instruction::Mul, Instruction::Shl,
+               Instruction::And, Instruction::Or, Instruction::Xor,
+               Instruction::FAdd, Instruction::FMul> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    AssociativeTree T;
+    if (!T.build(I) || T.Constants.size() < 2)
+      return false;
+
+    Constant *C = T.foldConstants();
+    Type *Ty = I->getType();
+    if (T.Leaves.empty() ||
+        C == ConstantExpr::getBinOpAbsorber(T.Opcode, Ty)) {
+      Plan.setResult(C);
+      return true;
+    }
+
+    stable_sort(T.Leaves, [](const auto &A, const auto &B) {
+      return A.first < B.first;
+    });
+    RewritePlan::Ref Acc = T.Leaves.front().second;
+    for (const auto &Leaf : drop_begin(T.Leaves))
+      Acc = T.combine(Plan, Acc, Leaf.second);
+    if (C != ConstantExpr::getBinOpIdentity(T.Opcode, Ty))
+      Acc = T.combine(Plan, Acc, C);
+    Plan.setResult(Acc);
+    return true;
+  }
+};
+
+// 22. Rebalance a long chain into a tree of logarithmic depth, e.g.
+// ((a + b) + c) + d -> (a + b) + (c + d), so that independent nodes can
+// issue in parallel. Operands are paired earliest available first, by rank,
+// and the tree is only rebuilt when that shortens its critical path
+struct BalanceTree
+    : RuleBase<Instruction::Add, Instruction::Mul, Instruction::And,
+               Instruction::Or, Instruction::Xor, Instruction::FAdd,
+               Instruction::FMul> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    AssociativeTree T;
+    if (AssociativeTree::isInnerNode(I) || !T.build(I))
+      return false;
+
+    // (ReadyTime, Order, Operand) in a min-heap; Order breaks ties so that
+    // the result does not depend on the heap implementation
+    using Entry = std::tuple<unsigned, unsigned, RewritePlan::Ref>;
+    auto later = [](const Entry &A, const Entry &B) {
+      return std::tie(std::get<0>(A), std::get<1>(A)) >
+             std::tie(std::get<0>(B), std::get<1>(B));
+    };
+    SmallVector<Entry, 8> Heap;
+    unsigned Order = 0;
+    for (const auto &Leaf : T.Leaves)
+      Heap.push_back({Leaf.first, Order++, Leaf.second});
+    for (Constant *C : T.Constants)
+      Heap.push_back({0, Order++, C});
+    std::make_heap(Heap.begin(), Heap.end(), later);
+
+    auto pop = [&]() {
+      std::pop_heap(Heap.begin(), Heap.end(), later);
+      return Heap.pop_back_val();
+    };
+    while (Heap.size() > 1) {
+      Entry A = pop(), B = pop();
+      unsigned Ready = std::max(std::get<0>(A), std::get<0>(B)) + 1;
+      Heap.push_back(
+          {Ready, Order++, T.combine(Plan, std::get<2>(A), std::get<2>(B))});
+      std::push_heap(Heap.begin(), Heap.end(), later);
+    }
+    if (std::get<0>(Heap.front()) >= T.Height)
+      return false;
+    Plan.setResult(std::get<2>(Heap.front()));
+    return true;
+  }
+};
+
+// Matches a shift by a constant amount that is in range, i.e. not poison
+template <typename ShiftT>
+static bool matchConstShift(Value *V, ShiftT Shift, const APInt *&ShAmt) {
+  return match(V, Shift) && ShAmt->ult(ShAmt->getBitWidth());
+}
+
+// 23. Consecutive shifts in the same direction -> one shift, e.g.
+// (x << 2) << 3 -> x << 5. Logical shifts past the width give zero and
+// arithmetic ones saturate at the sign bit
+struct MergeShifts
+    : RuleBase<Instruction::Shl, Instruction::LShr, Instruction::AShr> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *X;
+    const APInt *C1, *C2;
+    auto Opcode = static_cast<Instruction::BinaryOps>(I->getOpcode());
+    if (!matchConstShift(I, m_BinOp(Opcode, m_Value(X), m_APInt(C2)), C2) ||
+        !matchConstShift(X, m_BinOp(Opcode, m_Value(X), m_APInt(C1)), C1))
+      return false;
+
+    Type *Ty = I->getType();
+    unsigned BW = C1->getBitWidth();
+    uint64_t Amount = C1->getZExtValue() + C2->getZExtValue();
+    if (Amount >= BW) {
+      if (Opcode != Instruction::AShr) {
+        Plan.setResult(Constant::getNullValue(Ty));
+        return true;
+      }
+      Amount = BW - 1;
+    }
+    Plan.setResult(Plan.binOp(Opcode, X, ConstantInt::get(Ty, Amount)));
+    return true;
+  }
+};
+
+// 24. Opposite shifts -> one shift and a mask, e.g. (x << 4) >> 2 ->
+// (x << 2) & 0x3FFFFFFF and (x >> 3) << 3 -> x & -8. The mask is whatever
+// survives both shifts of an all-ones value. An arithmetic shift right
+// followed by a shift left at least as wide also qualifies, the copies of
+// the sign bit it brings in are shifted back out
+struct ShiftPairToMask : RuleBase<Instruction::Shl, Instruction::LShr> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *X, *Inner;
+    const APInt *C1, *C2;
+    unsigned Opcode = I->getOpcode();
+    if (!matchConstShift(I, m_Shift(m_Value(Inner), m_APInt(C2)), C2))
+      return false;
+    unsigned BW = C2->getBitWidth();
+    APInt Mask = APInt::getAllOnes(BW);
+    if (Opcode == Instruction::LShr &&
+        matchConstShift(Inner, m_Shl(m_Value(X), m_APInt(C1)), C1)) {
+      Mask = Mask.shl(*C1).lshr(*C2);
+    } else if (Opcode == Instruction::Shl &&
+               matchConstShift(Inner, m_LShr(m_Value(X), m_APInt(C1)), C1)) {
+      Mask = Mask.lshr(*C1).shl(*C2);
+    } else if (Opcode == Instruction::Shl &&
+               matchConstShift(Inner, m_AShr(m_Value(X), m_APInt(C1)), C1) &&
+               C1->uge(*C2)) {
+      Mask = Mask.shl(*C2);
+    } else {
+      return false;
+    }
+
+    // Shift by the difference in whichever direction the inner shift won
+    Type *Ty = I->getType();
+    RewritePlan::Ref Shifted = X;
+    unsigned InnerOpcode = cast<Instruction>(Inner)->getOpcode();
+    if (C1->ugt(*C2))
+      Shifted = Plan.binOp(static_cast<Instruction::BinaryOps>(InnerOpcode), X,
+                           ConstantInt::get(Ty, *C1 - *C2));
+    else if (C1->ult(*C2))
+      Shifted = Plan.binOp(static_cast<Instruction::BinaryOps>(Opcode), X,
+                           ConstantInt::get(Ty, *C2 - *C1));
+    if (Mask.isAllOnes())
+      Plan.setResult(Shifted);
+    else
+      Plan.setResult(
+          Plan.binOp(Instruction::And, Shifted, ConstantInt::get(Ty, Mask)));
+    return true;
+  }
+};
+
+// 25. Distribute a mask over a constant or, and drop the mask bits an or
+// already sets: (x | C1) & C2 -> (x & C2) | (C1 & C2) and
+// (x & C1) | C2 -> (x & (C1 & ~C2)) | C2. Either side collapses when the
+// constants cover or miss each other, e.g. (x | 0xFF) & 0xF0 -> 0xF0
+struct DistributeMask : RuleBase<Instruction::And, Instruction::Or> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *X;
+    const APInt *C1, *C2;
+    Type *Ty = I->getType();
+    if (match(I, m_c_And(m_Or(m_Value(X), m_APInt(C1)), m_APInt(C2)))) {
+      APInt Set = *C1 & *C2;
+      if (Set == *C2) {
+        Plan.setResult(ConstantInt::get(Ty, *C2));
+        return true;
+      }
+      auto Masked = Plan.binOp(Instruction::And, X, ConstantInt::get(Ty, *C2));
+      if (Set.isZero())
+        Plan.setResult(Masked);
+      else
+        Plan.setResult(
+            Plan.binOp(Instruction::Or, Masked, ConstantInt::get(Ty, Set)));
+      return true;
+    }
+
+    if (match(I, m_c_Or(m_And(m_Value(X), m_APInt(C1)), m_APInt(C2)))) {
+      APInt Kept = *C1 & ~*C2;
+      if (Kept == *C1)
+        return false;
+      if (Kept.isZero()) {
+        Plan.setResult(ConstantInt::get(Ty, *C2));
+        return true;
+      }
+      auto Masked = Plan.binOp(Instruction::And, X, ConstantInt::get(Ty, Kept));
+      Plan.setResult(
+          Plan.binOp(Instruction::Or, Masked, ConstantInt::get(Ty, *C2)));
+      return true;
+    }
+    return false;
+  }
+};
+
+// 26. Masks of the same value combine: (x & C1) | (x & C2) -> x & (C1 | C2)
+// and (x & C1) ^ (x & C2) -> x & (C1 ^ C2)
+struct MergeMasks : RuleBase<Instruction::Or, Instruction::Xor> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *X = nullptr;
+    const APInt *C1, *C2;
+    if (!match(I, m_BinOp(m_And(m_Value(X), m_APInt(C1)),
+                          m_And(m_Deferred(X), m_APInt(C2)))))
+      return false;
+    APInt Mask = I->getOpcode() == Instruction::Or ? *C1 | *C2 : *C1 ^ *C2;
+    Plan.setResult(
+        Plan.binOp(Instruction::And, X, ConstantInt::get(I->getType(), Mask)));
+    return true;
+  }
+};
+
+// 27. Integer operation whose every result bit is known -> constant
+struct KnownBitsConstant
+    : RuleBase<Instruction::Add, Instruction::Sub, Instruction::Mul,
+               Instruction::And, Instruction::Or, Instruction::Xor,
+               Instruction::Shl, Instruction::LShr, Instruction::AShr> {
+  static bool apply(Instruction *I, RewritePlan &Plan, RuleContext &Ctx) {
+    if (!I->getType()->isIntOrIntVectorTy())
+      return false;
+    KnownBits Known = Ctx.computeKnownBits(I, I);
+    if (!Known.isConstant())
+      return false;
+    Plan.setResult(ConstantInt::get(I->getType(), Known.getConstant()));
+    return true;
+  }
+};
+
+// 28. Mask that changes no bit anyone reads -> the masked value. An and is
+// redundant when the bits it clears are known zero or never demanded, an or
+// when the bits it sets are known one or never demanded, and a xor when the
+// bits it flips are never demanded
+struct DropRedundantMask
+    : RuleBase<Instruction::And, Instruction::Or, Instruction::Xor> {
+  static bool apply(Instruction *I, RewritePlan &Plan, RuleContext &Ctx) {
+    Value *X;
+    const APInt *C;
+    if (!match(I, m_BinOp(m_Value(X), m_APInt(C))))
+      return false;
+
+    // Bits the operation actually changes
+    APInt Changed = I->getOpcode() == Instruction::And ? ~*C : *C;
+    APInt Observed = Ctx.getDemandedBits(I) & Changed;
+    if (!Observed.isZero() && I->getOpcode() != Instruction::Xor) {
+      KnownBits Known = Ctx.computeKnownBits(X, I);
+      Observed &= I->getOpcode() == Instruction::And ? ~Known.Zero : ~Known.One;
+    }
+    if (!Observed.isZero())
+      return false;
+    Plan.setResult(X);
+    return true;
+  }
+};
+
+// 29. Add of operands with no set bit in common -> or, which never carries
+// and is what the mask rules understand
+struct DisjointAddToOr : RuleBase<Instruction::Add> {
+  static bool apply(Instruction *I, RewritePlan &Plan, RuleContext &Ctx) {
+    Value *X, *Y;
+    if (!match(I, m_Add(m_Value(X), m_Value(Y))) ||
+        !haveNoCommonBitsSet(X, Y, Ctx.getDataLayout(), &Ctx.getAC(), I,
+                             &Ctx.getDT()))
+      return false;
+    Plan.setResult(Plan.binOp(Instruction::Or, X, Y));
+    return true;
+  }
+};
 
-  // Verify type compatibility
-  bool verifyTypes(Value *Original, Value *Transformed) {
-    if (!Original || !Transformed)
+// 30. Integer comparison decided by the known bits of its operands
+struct FoldKnownICmp : RuleBase<Instruction::ICmp> {
+  static bool apply(Instruction *I, RewritePlan &Plan, RuleContext &Ctx) {
+    auto *Cmp = cast<ICmpInst>(I);
+    KnownBits LHS = Ctx.computeKnownBits(Cmp->getOperand(0), I);
+    KnownBits RHS = Ctx.computeKnownBits(Cmp->getOperand(1), I);
+    Optional<bool> Result;
+    switch (Cmp->getPredicate()) {
+    case ICmpInst::ICMP_EQ:
+      Result = KnownBits::eq(LHS, RHS);
+      break;
+    case ICmpInst::ICMP_NE:
+      Result = KnownBits::ne(LHS, RHS);
+      break;
+    case ICmpInst::ICMP_UGT:
+      Result = KnownBits::ugt(LHS, RHS);
+      break;
+    case ICmpInst::ICMP_UGE:
+      Result = KnownBits::uge(LHS, RHS);
+      break;
+    case ICmpInst::ICMP_ULT:
+      Result = KnownBits::ult(LHS, RHS);
+      break;
+    case ICmpInst::ICMP_ULE:
+      Result = KnownBits::ule(LHS, RHS);
+      break;
+    case ICmpInst::ICMP_SGT:
+      Result = KnownBits::sgt(LHS, RHS);
+      break;
+    case ICmpInst::ICMP_SGE:
+      Result = KnownBits::sge(LHS, RHS);
+      break;
+    case ICmpInst::ICMP_SLT:
+      Result = KnownBits::slt(LHS, RHS);
+      break;
+    case ICmpInst::ICMP_SLE:
+      Result = KnownBits::sle(LHS, RHS);
+      break;
+    default:
+      break;
+    }
+    if (!Result)
+      return false;
+    Plan.setResult(ConstantInt::getBool(I->getType(), *Result));
+    return true;
+  }
+};
+
+// 31. Operation whose high bits nobody demands -> the same operation on the
+// type an operand was extended from, e.g. trunc (add (zext a), (zext b))
+// computes the add on a's type. Low result bits only depend on low operand
+// bits for these opcodes, so the other operands are simply truncated
+struct NarrowUndemanded
+    : RuleBase<Instruction::Add, Instruction::Sub, Instruction::Mul,
+               Instruction::And, Instruction::Or, Instruction::Xor> {
+  static bool apply(Instruction *I, RewritePlan &Plan, RuleContext &Ctx) {
+    Type *Ty = I->getType();
+    if (!Ty->isIntOrIntVectorTy())
+      return false;
+    unsigned Active = Ctx.getDemandedBits(I).getActiveBits();
+
+    // The narrowest extension source that still holds every demanded bit
+    Type *NarrowTy = nullptr;
+    for (Value *Op : I->operands()) {
+      Value *Src;
+      if (!match(Op, m_ZExtOrSExt(m_Value(Src))))
+        continue;
+      unsigned SrcBW = Src->getType()->getScalarSizeInBits();
+      if (SrcBW >= Active &&
+          (!NarrowTy || SrcBW < NarrowTy->getScalarSizeInBits()))
+        NarrowTy = Src->getType();
+    }
+    if (!NarrowTy)
       return false;
-    return Original->getType() == Transformed->getType();
+
+    auto narrow = [&](Value *Op) -> RewritePlan::Ref {
+      Value *Src;
+      if (match(Op, m_ZExtOrSExt(m_Value(Src))) && Src->getType() == NarrowTy)
+        return Src;
+      if (auto *C = dyn_cast<Constant>(Op))
+        return ConstantExpr::getTrunc(C, NarrowTy);
+      return Plan.cast(Instruction::Trunc, Op, NarrowTy);
+    };
+    auto LHS = narrow(I->getOperand(0));
+    auto RHS = narrow(I->getOperand(1));
+    auto Narrow = Plan.binOp(
+        static_cast<Instruction::BinaryOps>(I->getOpcode()), LHS, RHS);
+    Plan.setResult(Plan.cast(Instruction::ZExt, Narrow, Ty));
+    return true;
+  }
+};
+
+// 32. Cast of a cast -> at most one cast: trunc (zext/sext x) becomes x, a
+// narrower trunc of x or a narrower extension of x, and zext (zext x) and
+// sext (sext x) extend x in one go
+struct CombineCasts
+    : RuleBase<Instruction::Trunc, Instruction::ZExt, Instruction::SExt> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *X;
+    Type *Ty = I->getType();
+    if (match(I, m_Trunc(m_ZExtOrSExt(m_Value(X))))) {
+      unsigned SrcBW = X->getType()->getScalarSizeInBits();
+      unsigned DestBW = Ty->getScalarSizeInBits();
+      if (SrcBW == DestBW)
+        Plan.setResult(X);
+      else if (SrcBW > DestBW)
+        Plan.setResult(Plan.cast(Instruction::Trunc, X, Ty));
+      else
+        Plan.setResult(Plan.cast(
+            static_cast<Instruction::CastOps>(
+                cast<Instruction>(I->getOperand(0))->getOpcode()),
+            X, Ty));
+      return true;
+    }
+    if (match(I, m_ZExt(m_ZExt(m_Value(X)))) ||
+        match(I, m_SExt(m_SExt(m_Value(X))))) {
+      Plan.setResult(Plan.cast(
+          static_cast<Instruction::CastOps>(I->getOpcode()), X, Ty));
+      return true;
+    }
+    return false;
+  }
+};
+
+// Op on NarrowTy, for an Op whose value is known to fit there: the source of
+// an extension is reused or extended the same way, constants are folded and
+// anything else is truncated
+static RewritePlan::Ref narrowOperand(RewritePlan &Plan, Value *Op,
+                                      Type *NarrowTy) {
+  Value *Src;
+  if (match(Op, m_ZExtOrSExt(m_Value(Src))) &&
+      Src->getType()->getScalarSizeInBits() <=
+          NarrowTy->getScalarSizeInBits()) {
+    if (Src->getType() == NarrowTy)
+      return Src;
+    return Plan.cast(
+        static_cast<Instruction::CastOps>(cast<Instruction>(Op)->getOpcode()),
+        Src, NarrowTy);
+  }
+  if (auto *C = dyn_cast<Constant>(Op))
+    return ConstantExpr::getTrunc(C, NarrowTy);
+  return Plan.cast(Instruction::Trunc, Op, NarrowTy);
+}
+
+// Widths of the extensions feeding I's operands
+static SmallVector<unsigned, 4> getExtendedWidths(Instruction *I) {
+  SmallVector<unsigned, 4> Widths;
+  for (Value *Op : I->operands()) {
+    Value *Src;
+    if (match(Op, m_ZExtOrSExt(m_Value(Src))))
+      Widths.push_back(Src->getType()->getScalarSizeInBits());
   }
+  return Widths;
+}
 
-  // Verify control flow preservation
-  bool verifyControlFlow(Instruction *Original, Instruction *Transformed) {
-    if (Original->isTerminator() != Transformed->isTerminator())
+// 33. Arithmetic whose operands and result fit a narrower type -> the same
+// arithmetic there, extended once. The candidates are the target's legal
+// widths and the widths the operands were extended from, narrowest first,
+// and LazyValueInfo bounds the values. Fitting as unsigned allows a zext of
+// the result, fitting as signed a sext, but only for operations that do not
+// depend on the sign. The narrow operation cannot wrap, so it keeps nuw or
+// nsw accordingly
+struct NarrowByRange
+    : RuleBase<Instruction::Add, Instruction::Sub, Instruction::Mul,
+               Instruction::UDiv, Instruction::URem, Instruction::LShr,
+               Instruction::And, Instruction::Or, Instruction::Xor> {
+  static bool apply(Instruction *I, RewritePlan &Plan, RuleContext &Ctx) {
+    Type *Ty = I->getType();
+    if (!Ty->isIntegerTy())
       return false;
+    // Only worth the range queries when an extension goes away, except for
+    // division, which gets faster with the width on most targets
+    SmallVector<unsigned, 4> Widths = getExtendedWidths(I);
+    bool IsDivision = I->getOpcode() == Instruction::UDiv ||
+                      I->getOpcode() == Instruction::URem;
+    if (Widths.empty() && !IsDivision)
+      return false;
+    unsigned BW = Ty->getIntegerBitWidth();
+    append_range(Widths, Ctx.getLegalWidthsBelow(BW));
+    sort(Widths);
+
+    auto Opcode = static_cast<Instruction::BinaryOps>(I->getOpcode());
+    Value *X = I->getOperand(0), *Y = I->getOperand(1);
+    ConstantRange XR = Ctx.getRange(X, I), YR = Ctx.getRange(Y, I);
+    ConstantRange R = XR.binaryOp(Opcode, YR);
+    bool SignAgnostic = Opcode != Instruction::UDiv &&
+                        Opcode != Instruction::URem &&
+                        Opcode != Instruction::LShr;
+    for (unsigned Width : Widths) {
+      if (Width >= BW)
+        break;
+      // A shift amount must also stay below the narrow width, or the narrow
+      // shift is poison where the wide one just shifts everything out
+      bool Unsigned =
+          XR.getActiveBits() <= Width && YR.getActiveBits() <= Width &&
+          R.getActiveBits() <= Width &&
+          (Opcode != Instruction::LShr || YR.getUnsignedMax().ult(Width));
+      bool Signed = SignAgnostic && XR.getMinSignedBits() <= Width &&
+                    YR.getMinSignedBits() <= Width &&
+                    R.getMinSignedBits() <= Width;
+      if (!Unsigned && !Signed)
+        continue;
+
+      // The narrowest width is not always the cheapest, e.g. when extending
+      // back from it is not free, so the first profitable one wins
+      RewritePlan Candidate;
+      Type *NarrowTy = IntegerType::get(I->getContext(), Width);
+      auto Narrow =
+          Candidate.binOp(Opcode, narrowOperand(Candidate, X, NarrowTy),
+                          narrowOperand(Candidate, Y, NarrowTy));
+      if (isa<OverflowingBinaryOperator>(I))
+        Candidate.setNoWrapFlags(Narrow, Unsigned, !Unsigned);
+      Candidate.setResult(Candidate.cast(
+          Unsigned ? Instruction::ZExt : Instruction::SExt, Narrow, Ty));
+      if (Ctx.isProfitable(I, Candidate)) {
+        Plan = std::move(Candidate);
+        return true;
+      }
+    }
+    return false;
+  }
+};
 
-    if (Original->mayHaveSideEffects() != Transformed->mayHaveSideEffects())
+// 34. Comparison of extended values -> a comparison of the narrow values,
+// and one that the operand ranges decide -> a constant. Narrowing values
+// that fit as signed preserves every predicate, since sext is monotonic in
+// both orders; values that only fit as unsigned keep unsigned and equality
+// predicates
+struct NarrowICmp : RuleBase<Instruction::ICmp> {
+  static bool apply(Instruction *I, RewritePlan &Plan, RuleContext &Ctx) {
+    auto *Cmp = cast<ICmpInst>(I);
+    Value *X = Cmp->getOperand(0), *Y = Cmp->getOperand(1);
+    if (!X->getType()->isIntegerTy())
       return false;
+    ConstantRange XR = Ctx.getRange(X, I), YR = Ctx.getRange(Y, I);
+    if (XR.icmp(Cmp->getPredicate(), YR)) {
+      Plan.setResult(ConstantInt::getTrue(I->getType()));
+      return true;
+    }
+    if (XR.icmp(Cmp->getInversePredicate(), YR)) {
+      Plan.setResult(ConstantInt::getFalse(I->getType()));
+      return true;
+    }
 
+    SmallVector<unsigned, 4> Widths = getExtendedWidths(I);
+    if (Widths.empty())
+      return false;
+    unsigned Width = *std::min_element(Widths.begin(), Widths.end());
+    bool Signed =
+        XR.getMinSignedBits() <= Width && YR.getMinSignedBits() <= Width;
+    bool Unsigned = !Cmp->isSigned() && XR.getActiveBits() <= Width &&
+                    YR.getActiveBits() <= Width;
+    if (!Signed && !Unsigned)
+      return false;
+    Type *NarrowTy = IntegerType::get(I->getContext(), Width);
+    Plan.setResult(Plan.icmp(Cmp->getPredicate(),
+                             narrowOperand(Plan, X, NarrowTy),
+                             narrowOperand(Plan, Y, NarrowTy)));
     return true;
   }
+};
 
-  // Verify memory access patterns
-  bool verifyMemoryAccess(Instruction *Original, Instruction *Transformed,
-                          const MemorySSA &MSSA) {
-    bool OriginalReads = Original->mayReadFromMemory();
-    bool OriginalWrites = Original->mayWriteToMemory();
-    bool TransformedReads = Transformed->mayReadFromMemory();
-    bool TransformedWrites = Transformed->mayWriteToMemory();
+// 35. Sign extension of a value known to be non-negative -> zero extension
+struct SExtToZExt : RuleBase<Instruction::SExt> {
+  static bool apply(Instruction *I, RewritePlan &Plan, RuleContext &Ctx) {
+    Value *X = I->getOperand(0);
+    if (!X->getType()->isIntegerTy() ||
+        !Ctx.getRange(X, I).isAllNonNegative())
+      return false;
+    Plan.setResult(Plan.cast(Instruction::ZExt, X, I->getType()));
+    return true;
+  }
+};
 
-    // Check if memory access patterns match
-    if (OriginalReads != TransformedReads ||
-        OriginalWrites != TransformedWrites)
+// 36. Truncation and extension that round-trip the value -> the value, or
+// one cast to the final type: zext (trunc x) when x fits the narrow type as
+// unsigned and sext (trunc x) when it fits as signed
+struct DropRedundantTruncExt
+    : RuleBase<Instruction::ZExt, Instruction::SExt> {
+  static bool apply(Instruction *I, RewritePlan &Plan, RuleContext &Ctx) {
+    Value *X;
+    if (!match(I->getOperand(0), m_Trunc(m_Value(X))) ||
+        !X->getType()->isIntegerTy())
+      return false;
+    unsigned Width = I->getOperand(0)->getType()->getIntegerBitWidth();
+    ConstantRange XR = Ctx.getRange(X, I);
+    bool IsZExt = I->getOpcode() == Instruction::ZExt;
+    if ((IsZExt ? XR.getActiveBits() : XR.getMinSignedBits()) > Width)
       return false;
 
-    // If there are memory operations, verify they're equivalent
-    if (OriginalReads || OriginalWrites) {
-      auto *OriginalMA = MSSA.getMemoryAccess(Original);
-      auto *TransformedMA = MSSA.getMemoryAccess(Transformed);
+    Type *Ty = I->getType();
+    unsigned SrcBW = X->getType()->getIntegerBitWidth();
+    unsigned DestBW = Ty->getIntegerBitWidth();
+    if (SrcBW == DestBW)
+      Plan.setResult(X);
+    else if (SrcBW > DestBW)
+      Plan.setResult(Plan.cast(Instruction::Trunc, X, Ty));
+    else
+      Plan.setResult(Plan.cast(
+          static_cast<Instruction::CastOps>(I->getOpcode()), X, Ty));
+    return true;
+  }
+};
 
-      if (!OriginalMA || !TransformedMA)
+// 37. Comparison canonicalization and folding: constants go to the right
+// with the predicate swapped, comparisons of two constants fold, and so do
+// comparisons of a value with itself
+struct CanonicalizeICmp : RuleBase<Instruction::ICmp> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    auto *Cmp = cast<ICmpInst>(I);
+    Value *X = Cmp->getOperand(0), *Y = Cmp->getOperand(1);
+    ICmpInst::Predicate Pred = Cmp->getPredicate();
+    if (X == Y) {
+      Plan.setResult(
+          ConstantInt::getBool(I->getType(), ICmpInst::isTrueWhenEqual(Pred)));
+      return true;
+    }
+    auto *CX = dyn_cast<Constant>(X), *CY = dyn_cast<Constant>(Y);
+    if (CX && CY) {
+      Constant *Folded = ConstantExpr::getICmp(Pred, CX, CY);
+      if (!match(Folded, m_ImmConstant()))
         return false;
+      Plan.setResult(Folded);
+      return true;
+    }
+    if (!CX)
+      return false;
+    Plan.setResult(Plan.icmp(ICmpInst::getSwappedPredicate(Pred), Y, X));
+    return true;
+  }
+};
 
-      // Verify memory dependencies are preserved
-      return MSSA.dominates(OriginalMA, TransformedMA);
+// 38. Comparison of an extended boolean, or of a boolean itself, with a
+// constant -> the boolean or its negation, e.g. (zext b) == 1 -> b and
+// (zext b) == 0 -> !b. Constants the boolean cannot take fold the whole
+// comparison
+struct BoolICmp : RuleBase<Instruction::ICmp> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    auto *Cmp = cast<ICmpInst>(I);
+    Value *B;
+    const APInt *C;
+    if (!Cmp->isEquality() || !match(Cmp->getOperand(1), m_APInt(C)))
+      return false;
+    // The constant as the boolean it stands for, if any
+    Optional<bool> Bit;
+    Value *Op = Cmp->getOperand(0);
+    if (match(Op, m_ZExt(m_Value(B))) && B->getType()->isIntOrIntVectorTy(1)) {
+      if (C->isZero() || C->isOne())
+        Bit = C->isOne();
+    } else if (match(Op, m_SExt(m_Value(B))) &&
+               B->getType()->isIntOrIntVectorTy(1)) {
+      if (C->isZero() || C->isAllOnes())
+        Bit = C->isAllOnes();
+    } else if (Op->getType()->isIntOrIntVectorTy(1)) {
+      B = Op;
+      Bit = C->isOne();
+    } else {
+      return false;
     }
 
+    bool IsEq = Cmp->getPredicate() == ICmpInst::ICMP_EQ;
+    if (!Bit)
+      Plan.setResult(ConstantInt::getBool(I->getType(), !IsEq));
+    else if (IsEq == *Bit)
+      Plan.setResult(B);
+    else
+      Plan.setResult(
+          Plan.binOp(Instruction::Xor, B, ConstantInt::getTrue(I->getType())));
     return true;
   }
+};
 
-  // Verify data dependencies
-  bool verifyDataDependencies(Instruction *Original, Instruction *Transformed,
-                              DependencyInfo &DepInfo) {
-    // Check if all required operands are available
-    for (Use &U : Transformed->operands()) {
-      if (auto *Op = dyn_cast<Instruction>(U.get())) {
-        // Verify no circular dependencies are introduced
-        if (DepInfo.RAW.count(Op) || DepInfo.WAW.count(Op))
-          return false;
-      }
+// 39. Negated comparison -> the inverse comparison, e.g. !(x != y) -> x == y
+struct InvertICmp : RuleBase<Instruction::Xor> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *X, *Y;
+    ICmpInst::Predicate Pred;
+    if (!match(I, m_Not(m_ICmp(Pred, m_Value(X), m_Value(Y)))))
+      return false;
+    Plan.setResult(Plan.icmp(ICmpInst::getInversePredicate(Pred), X, Y));
+    return true;
+  }
+};
+
+// 40. Two comparisons of the same operands joined by and, or or xor -> one
+// comparison or a constant, e.g. (x < y) | (x == y) -> x <= y. Each
+// predicate is a three bit code for <, == and >, which combine bitwise.
+// The short-circuit forms, select a, b, false and select a, true, b, are
+// included: both sides compare the same values, so the second one can only
+// be poison when the first one is too
+struct CombineICmps
+    : RuleBase<Instruction::And, Instruction::Or, Instruction::Xor,
+               Instruction::Select> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *A, *B;
+    unsigned Opcode;
+    if (match(I, m_LogicalAnd(m_Value(A), m_Value(B))))
+      Opcode = Instruction::And;
+    else if (match(I, m_LogicalOr(m_Value(A), m_Value(B))))
+      Opcode = Instruction::Or;
+    else if (match(I, m_Xor(m_Value(A), m_Value(B))))
+      Opcode = Instruction::Xor;
+    else
+      return false;
+    auto *LHS = dyn_cast<ICmpInst>(A), *RHS = dyn_cast<ICmpInst>(B);
+    if (!LHS || !RHS ||
+        !predicatesFoldable(LHS->getPredicate(), RHS->getPredicate()))
+      return false;
+
+    Value *X = LHS->getOperand(0), *Y = LHS->getOperand(1);
+    unsigned LHSCode = getICmpCode(LHS), RHSCode = getICmpCode(RHS);
+    if (RHS->getOperand(0) == Y && RHS->getOperand(1) == X)
+      // Swapping the operands swaps the meaning of the < and > bits
+      RHSCode = (RHSCode & 2) | (RHSCode & 1) << 2 | (RHSCode & 4) >> 2;
+    else if (RHS->getOperand(0) != X || RHS->getOperand(1) != Y)
+      return false;
+
+    unsigned Code = Opcode == Instruction::And  ? LHSCode & RHSCode
+                    : Opcode == Instruction::Or ? LHSCode | RHSCode
+                                                : LHSCode ^ RHSCode;
+    bool IsSigned = LHS->isSigned() || RHS->isSigned();
+    ICmpInst::Predicate Pred;
+    if (Constant *C = getPredForICmpCode(Code, IsSigned, X->getType(), Pred)) {
+      Plan.setResult(C);
+      return true;
     }
+    Plan.setResult(Plan.icmp(Pred, X, Y));
+    return true;
+  }
+};
 
-    // Update dependency information
-    for (Use &U : Original->operands()) {
-      if (auto *Op = dyn_cast<Instruction>(U.get())) {
-        DepInfo.RAW.insert(Op);
+// 41. Select folding: a constant condition or equal arms pick an arm,
+// boolean arms turn the select into its condition, a negated condition
+// swaps the arms, and select (x == y), x, y is just y
+struct FoldSelect : RuleBase<Instruction::Select> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *Cond, *TrueV, *FalseV, *X;
+    if (!match(I, m_Select(m_Value(Cond), m_Value(TrueV), m_Value(FalseV))))
+      return false;
+    if (TrueV == FalseV || match(Cond, m_One())) {
+      Plan.setResult(TrueV);
+      return true;
+    }
+    if (match(Cond, m_Zero())) {
+      Plan.setResult(FalseV);
+      return true;
+    }
+    if (Cond->getType() == I->getType()) {
+      if (match(TrueV, m_One()) && match(FalseV, m_Zero())) {
+        Plan.setResult(Cond);
+        return true;
       }
+      if (match(TrueV, m_Zero()) && match(FalseV, m_One())) {
+        Plan.setResult(Plan.binOp(Instruction::Xor, Cond,
+                                  ConstantInt::getTrue(I->getType())));
+        return true;
+      }
+    }
+    if (match(Cond, m_Not(m_Value(X)))) {
+      Plan.setResult(Plan.select(X, FalseV, TrueV));
+      return true;
+    }
+    ICmpInst::Predicate Pred;
+    if (match(Cond, m_c_ICmp(Pred, m_Specific(TrueV), m_Specific(FalseV))) &&
+        ICmpInst::isEquality(Pred)) {
+      Plan.setResult(Pred == ICmpInst::ICMP_EQ ? FalseV : TrueV);
+      return true;
     }
+    return false;
+  }
+};
 
+// 42. PHI merging a single value, apart from references to itself -> that
+// value. Folded branches leave these behind
+struct FoldPHI : RuleBase<Instruction::PHI> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *V = cast<PHINode>(I)->hasConstantValue();
+    if (!V)
+      return false;
+    Plan.setResult(V);
     return true;
   }
+};
 
-  // Verify arithmetic properties
-  bool verifyArithmetic(Instruction *Original, Instruction *Transformed,
-                        ScalarEvolution &SE) {
-    // Only verify arithmetic instructions
-    if (!Original->isBinaryOp() || !Transformed->isBinaryOp())
-      return true;
+// 43. Select of the two values a comparison orders -> llvm.smin, smax,
+// umin or umax, e.g. a < b ? a : b -> smin(a, b). Constants go second
+struct MinMaxToIntrinsic : RuleBase<Instruction::Select> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *A, *B;
+    Intrinsic::ID IID;
+    if (match(I, m_SMax(m_Value(A), m_Value(B))))
+      IID = Intrinsic::smax;
+    else if (match(I, m_SMin(m_Value(A), m_Value(B))))
+      IID = Intrinsic::smin;
+    else if (match(I, m_UMax(m_Value(A), m_Value(B))))
+      IID = Intrinsic::umax;
+    else if (match(I, m_UMin(m_Value(A), m_Value(B))))
+      IID = Intrinsic::umin;
+    else
+      return false;
+    if (isa<Constant>(A))
+      std::swap(A, B);
+    Plan.setResult(Plan.intrinsic(IID, {A, B}));
+    return true;
+  }
+};
 
-    // Get SCEV expressions for both instructions
-    const SCEV *OriginalSCEV = SE.getSCEV(Original);
-    const SCEV *TransformedSCEV = SE.getSCEV(Transformed);
+// 44. Select between a value and its negation on the value's sign ->
+// llvm.abs, e.g. x < 0 ? -x : x -> abs(x) and x < 0 ? x : -x -> -abs(x).
+// INT_MIN is not poison for the intrinsic, as it is not for the negation
+struct AbsToIntrinsic : RuleBase<Instruction::Select> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Value *LHS, *RHS;
+    SelectPatternFlavor SPF = matchSelectPattern(I, LHS, RHS).Flavor;
+    if (SPF != SPF_ABS && SPF != SPF_NABS)
+      return false;
+    // The pattern also covers a - b against b - a; only take a plain
+    // negation so that the result is exactly abs of one of the arms
+    auto *Sel = cast<SelectInst>(I);
+    Value *TrueV = Sel->getTrueValue(), *FalseV = Sel->getFalseValue();
+    Value *X;
+    if (match(TrueV, m_Neg(m_Specific(FalseV))))
+      X = FalseV;
+    else if (match(FalseV, m_Neg(m_Specific(TrueV))))
+      X = TrueV;
+    else
+      return false;
 
-    // Compare SCEV expressions for equivalence
-    return OriginalSCEV == TransformedSCEV;
+    RewritePlan::Ref Abs = Plan.intrinsic(
+        Intrinsic::abs, {X, ConstantInt::getFalse(I->getContext())});
+    if (SPF == SPF_NABS)
+      Abs = Plan.binOp(Instruction::Sub, Constant::getNullValue(I->getType()),
+                       Abs);
+    Plan.setResult(Abs);
+    return true;
   }
+};
+
+// 45. Clamp written as a comparison against the lower bound around a min
+// with the upper one -> max of the min, e.g.
+// x < lo ? lo : smin(x, hi) -> smax(smin(x, hi), lo) when lo <= hi, and
+// the same with the bounds' roles swapped
+struct ClampToMinMax : RuleBase<Instruction::Select> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    auto *Sel = cast<SelectInst>(I);
+    Value *X, *TrueV = Sel->getTrueValue(), *FalseV = Sel->getFalseValue();
+    const APInt *Bound, *Other;
+    ICmpInst::Predicate Pred;
+    if (!match(Sel->getCondition(),
+               m_ICmp(Pred, m_Value(X), m_APInt(Bound))) ||
+        ICmpInst::isEquality(Pred))
+      return false;
+    // Make the bound the true arm
+    if (match(FalseV, m_SpecificInt(*Bound))) {
+      std::swap(TrueV, FalseV);
+      Pred = ICmpInst::getInversePredicate(Pred);
+    }
+    if (!match(TrueV, m_SpecificInt(*Bound)))
+      return false;
 
-  // Verify exception behavior
-  bool verifyExceptions(Instruction *Original, Instruction *Transformed) {
-    return Original->mayThrow() == Transformed->mayThrow();
+    // x below the bound takes the bound, so the bound is the lower one and
+    // the other arm must already be clamped from above, and vice versa
+    bool Signed = ICmpInst::isSigned(Pred);
+    bool IsLower = ICmpInst::isLT(Pred) || ICmpInst::isLE(Pred);
+    Intrinsic::ID IID;
+    if (Signed && IsLower &&
+        match(FalseV, m_SMin(m_Specific(X), m_APInt(Other))) &&
+        Bound->sle(*Other))
+      IID = Intrinsic::smax;
+    else if (Signed && !IsLower &&
+             match(FalseV, m_SMax(m_Specific(X), m_APInt(Other))) &&
+             Bound->sge(*Other))
+      IID = Intrinsic::smin;
+    else if (!Signed && IsLower &&
+             match(FalseV, m_UMin(m_Specific(X), m_APInt(Other))) &&
+             Bound->ule(*Other))
+      IID = Intrinsic::umax;
+    else if (!Signed && !IsLower &&
+             match(FalseV, m_UMax(m_Specific(X), m_APInt(Other))) &&
+             Bound->uge(*Other))
+      IID = Intrinsic::umin;
+    else
+      return false;
+    Plan.setResult(Plan.intrinsic(IID, {FalseV, TrueV}));
+    return true;
   }
+};
 
-public:
-  bool verify(Instruction *Original, Value *Transformed, Function &F,
-              FunctionAnalysisManager &FAM) {
-    // Get required analyses
-    auto &MSSA = FAM.getResult<MemorySSAAnalysis>(F).getMSSA();
-    auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+// Whether V is C, for a scalar or splat constant C
+static bool isConstantInt(Value *V, const APInt &C) {
+  return match(V, m_SpecificInt(C));
+}
 
-    // Cast transformed value to instruction if possible
-    auto *TransformedInst = dyn_cast<Instruction>(Transformed);
-    if (!TransformedInst)
+// 46. Overflow checks around unsigned add and sub -> llvm.uadd.sat and
+// llvm.usub.sat, e.g. a > b ? a - b : 0 -> usub.sat(a, b) and
+// a + b < a ? UINT_MAX : a + b -> uadd.sat(a, b). A subtracted or added
+// constant may appear as an add of its negation or a test against its
+// complement, e.g. x > ~c ? UINT_MAX : x + c
+struct SaturatingSelect : RuleBase<Instruction::Select> {
+  // The comparison in Cond, or its inverse, such that it holds exactly
+  // when the select picks Arm, with L as its first operand if possible
+  static bool getArmCondition(SelectInst *Sel, Value *Arm, Value *L,
+                              ICmpInst::Predicate &Pred, Value *&R) {
+    Value *CmpL, *CmpR;
+    if (!match(Sel->getCondition(),
+               m_ICmp(Pred, m_Value(CmpL), m_Value(CmpR))))
       return false;
+    if (Sel->getFalseValue() == Arm)
+      Pred = ICmpInst::getInversePredicate(Pred);
+    if (CmpR == L) {
+      std::swap(CmpL, CmpR);
+      Pred = ICmpInst::getSwappedPredicate(Pred);
+    }
+    R = CmpR;
+    return CmpL == L;
+  }
 
-    // Initialize dependency tracking
-    DependencyInfo DepInfo;
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    auto *Sel = cast<SelectInst>(I);
+    Value *TrueV = Sel->getTrueValue(), *FalseV = Sel->getFalseValue();
+    if (!I->getType()->isIntOrIntVectorTy())
+      return false;
+    Value *A, *B, *R;
+    const APInt *C;
+    ICmpInst::Predicate Pred;
 
-    // Run all verification checks
-    if (!verifyTypes(Original, Transformed))
+    // usub.sat: the difference when a >= b, zero otherwise
+    for (Value *Arm : {TrueV, FalseV}) {
+      Value *Zero = Arm == TrueV ? FalseV : TrueV;
+      if (!match(Zero, m_Zero()))
+        continue;
+      if (match(Arm, m_Add(m_Value(A), m_APInt(C))))
+        B = ConstantInt::get(I->getType(), -*C);
+      else if (!match(Arm, m_Sub(m_Value(A), m_Value(B))))
+        continue;
+      if (!getArmCondition(Sel, Arm, A, Pred, R))
+        continue;
+      // a > b - 1 is a >= b when b is a constant
+      const APInt *BC;
+      bool Holds =
+          ((Pred == ICmpInst::ICMP_UGE || Pred == ICmpInst::ICMP_UGT) &&
+           R == B) ||
+          (Pred == ICmpInst::ICMP_UGE && match(B, m_APInt(BC)) &&
+           isConstantInt(R, *BC)) ||
+          (Pred == ICmpInst::ICMP_UGT && match(B, m_APInt(BC)) &&
+           !BC->isZero() && isConstantInt(R, *BC - 1));
+      if (!Holds)
+        continue;
+      Plan.setResult(Plan.intrinsic(Intrinsic::usub_sat, {A, B}));
+      return true;
+    }
+
+    // uadd.sat: all ones when the sum wrapped, the sum otherwise
+    for (Value *Sum : {TrueV, FalseV}) {
+      Value *Saturated = Sum == TrueV ? FalseV : TrueV;
+      if (!match(Saturated, m_AllOnes()) ||
+          !match(Sum, m_Add(m_Value(A), m_Value(B))))
+        continue;
+      // The sum wrapped iff it is below either addend...
+      if (getArmCondition(Sel, Saturated, Sum, Pred, R) &&
+          Pred == ICmpInst::ICMP_ULT && (R == A || R == B)) {
+        Plan.setResult(Plan.intrinsic(Intrinsic::uadd_sat, {A, B}));
+        return true;
+      }
+      // ...or, for a constant c, iff the other addend is above ~c
+      if (match(B, m_APInt(C)) &&
+          getArmCondition(Sel, Saturated, A, Pred, R) &&
+          ((Pred == ICmpInst::ICMP_UGT && isConstantInt(R, ~*C)) ||
+           (Pred == ICmpInst::ICMP_UGE && !C->isZero() &&
+            isConstantInt(R, ~*C + 1)))) {
+        Plan.setResult(Plan.intrinsic(Intrinsic::uadd_sat, {A, B}));
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+// 47. Add or sub done in a wider type and clamped to the narrow type's
+// range before truncating -> the saturating intrinsic on the narrow type,
+// e.g. (i8)smin(smax((i32)a + (i32)b, -128), 127) -> sadd.sat(a, b) and
+// (i8)umin((u32)a + (u32)b, 255) -> uadd.sat(a, b)
+struct SaturatingClamp : RuleBase<Instruction::Trunc> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Type *NarrowTy = I->getType();
+    Value *Clamped = I->getOperand(0), *S, *A, *B;
+    // The extended operands leave the wider type at least one spare bit, so
+    // the wide add or sub itself never wraps
+    unsigned BW = NarrowTy->getScalarSizeInBits();
+    unsigned WideBW = Clamped->getType()->getScalarSizeInBits();
+    APInt SMin = APInt::getSignedMinValue(BW).sext(WideBW);
+    APInt SMax = APInt::getSignedMaxValue(BW).sext(WideBW);
+    APInt UMax = APInt::getMaxValue(BW).zext(WideBW);
+    auto isNarrow = [&](Value *V) { return V->getType() == NarrowTy; };
+
+    // Clamped to the signed range from both sides, in either order
+    const APInt *Lo, *Hi;
+    if (match(Clamped,
+              m_SMin(m_SMax(m_Value(S), m_APInt(Lo)), m_APInt(Hi))) ||
+        match(Clamped,
+              m_SMax(m_SMin(m_Value(S), m_APInt(Hi)), m_APInt(Lo)))) {
+      Intrinsic::ID IID;
+      if (*Lo == SMin && *Hi == SMax &&
+          match(S, m_Add(m_SExt(m_Value(A)), m_SExt(m_Value(B)))))
+        IID = Intrinsic::sadd_sat;
+      else if (*Lo == SMin && *Hi == SMax &&
+               match(S, m_Sub(m_SExt(m_Value(A)), m_SExt(m_Value(B)))))
+        IID = Intrinsic::ssub_sat;
+      else if (Lo->isZero() && *Hi == UMax &&
+               match(S, m_Sub(m_ZExt(m_Value(A)), m_ZExt(m_Value(B)))))
+        IID = Intrinsic::usub_sat;
+      else
+        return false;
+      if (!isNarrow(A) || !isNarrow(B))
+        return false;
+      Plan.setResult(Plan.intrinsic(IID, {A, B}));
+      return true;
+    }
+
+    // Clamped from the one side an unsigned operation can leave the range
+    if (match(Clamped, m_UMin(m_Value(S), m_APInt(Hi))) && *Hi == UMax &&
+        match(S, m_Add(m_ZExt(m_Value(A)), m_ZExt(m_Value(B)))) &&
+        isNarrow(A) && isNarrow(B)) {
+      Plan.setResult(Plan.intrinsic(Intrinsic::uadd_sat, {A, B}));
+      return true;
+    }
+    if (match(Clamped, m_SMax(m_Value(S), m_Zero())) &&
+        match(S, m_Sub(m_ZExt(m_Value(A)), m_ZExt(m_Value(B)))) &&
+        isNarrow(A) && isNarrow(B)) {
+      Plan.setResult(Plan.intrinsic(Intrinsic::usub_sat, {A, B}));
+      return true;
+    }
+    return false;
+  }
+};
+
+// Where each byte of a value comes from: byte I is byte Bytes[I] of Source,
+// or known zero when Bytes[I] is negative
+struct ByteProvenance {
+  Value *Source = nullptr;
+  SmallVector<int, 8> Bytes;
+};
+
+// Upper bound on the instructions collectBytes looks through
+static constexpr unsigned MaxByteProvenanceSize = 64;
+
+// Follow V through byte-aligned shifts, byte masks, zero extensions and
+// ors of values with no byte in common, down to a single source value.
+// Anything else is taken as a source in its own right
+static Optional<ByteProvenance> collectBytes(Value *V, unsigned &Budget) {
+  unsigned NumBytes = V->getType()->getScalarSizeInBits() / 8;
+  auto *I = dyn_cast<Instruction>(V);
+  const APInt *C;
+  ByteProvenance P;
+  if (match(V, m_Zero())) {
+    P.Bytes.assign(NumBytes, -1);
+    return P;
+  }
+  if (!I || !Budget || I->getType()->getScalarSizeInBits() % 8)
+    return ByteProvenance{V, to_vector<8>(seq<int>(0, NumBytes))};
+  --Budget;
+
+  auto collectOp = [&](unsigned Idx) {
+    return collectBytes(I->getOperand(Idx), Budget);
+  };
+  switch (I->getOpcode()) {
+  case Instruction::Or: {
+    auto L = collectOp(0), R = collectOp(1);
+    if (!L || !R)
+      return None;
+    if (L->Source && R->Source && L->Source != R->Source)
+      return None;
+    P.Source = L->Source ? L->Source : R->Source;
+    for (unsigned Idx = 0; Idx < NumBytes; ++Idx) {
+      if (L->Bytes[Idx] >= 0 && R->Bytes[Idx] >= 0)
+        return None;
+      P.Bytes.push_back(std::max(L->Bytes[Idx], R->Bytes[Idx]));
+    }
+    return P;
+  }
+  case Instruction::Shl:
+  case Instruction::LShr: {
+    if (!match(I->getOperand(1), m_APInt(C)) || C->uge(NumBytes * 8) ||
+        C->urem(8))
+      break;
+    auto Op = collectOp(0);
+    if (!Op)
+      return None;
+    int Shift = C->getZExtValue() / 8;
+    P.Source = Op->Source;
+    P.Bytes.assign(NumBytes, -1);
+    for (int Idx = 0; Idx < (int)NumBytes; ++Idx) {
+      int From =
+          I->getOpcode() == Instruction::Shl ? Idx - Shift : Idx + Shift;
+      if (From >= 0 && From < (int)NumBytes)
+        P.Bytes[Idx] = Op->Bytes[From];
+    }
+    return P;
+  }
+  case Instruction::And: {
+    if (!match(I->getOperand(1), m_APInt(C)))
+      break;
+    auto Op = collectOp(0);
+    if (!Op)
+      return None;
+    P = *Op;
+    for (unsigned Idx = 0; Idx < NumBytes; ++Idx) {
+      uint64_t Mask = C->extractBitsAsZExtValue(8, Idx * 8);
+      if (Mask == 0)
+        P.Bytes[Idx] = -1;
+      else if (Mask != 0xFF)
+        return None;
+    }
+    return P;
+  }
+  case Instruction::ZExt: {
+    if (I->getOperand(0)->getType()->getScalarSizeInBits() % 8)
+      break;
+    auto Op = collectOp(0);
+    if (!Op)
+      return None;
+    P = *Op;
+    P.Bytes.resize(NumBytes, -1);
+    return P;
+  }
+  default:
+    break;
+  }
+  return ByteProvenance{V, to_vector<8>(seq<int>(0, NumBytes))};
+}
+
+// 48. Ladder of shifts, masks and ors that reverses the bytes of a value
+// -> llvm.bswap, e.g. (x << 24) | ((x & 0xFF00) << 8) |
+// ((x >> 8) & 0xFF00) | (x >> 24) -> bswap(x)
+struct ByteSwap : RuleBase<Instruction::Or> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    unsigned BW = I->getType()->getScalarSizeInBits();
+    if (!I->getType()->isIntOrIntVectorTy() || BW < 16 || BW % 16)
+      return false;
+    unsigned Budget = MaxByteProvenanceSize;
+    auto P = collectBytes(I, Budget);
+    if (!P || !P->Source || P->Source->getType() != I->getType())
       return false;
+    unsigned NumBytes = BW / 8;
+    for (unsigned Idx = 0; Idx < NumBytes; ++Idx)
+      if (P->Bytes[Idx] != int(NumBytes - 1 - Idx))
+        return false;
+    Plan.setResult(Plan.intrinsic(Intrinsic::bswap, {P->Source}));
+    return true;
+  }
+};
 
-    if (!verifyControlFlow(Original, TransformedInst))
+// 49. Or of a value shifted left and another shifted right by amounts that
+// add up to the width -> llvm.fshl or llvm.fshr, e.g.
+// (x << r) | (x >> (32 - r)) -> fshl(x, x, r). A shift by the full width
+// is poison, so the funnel shift's result for r == 0 is a refinement.
+// Rotates with both amounts masked, (x << (r & 31)) | (x >> (-r & 31)),
+// are well-defined for every r and become the same rotate
+struct FunnelShift : RuleBase<Instruction::Or> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    Type *Ty = I->getType();
+    unsigned BW = Ty->getScalarSizeInBits();
+    Value *X, *Y, *L, *R, *Amt;
+    const APInt *C1, *C2;
+    if (!match(I, m_c_Or(m_Shl(m_Value(X), m_Value(L)),
+                         m_LShr(m_Value(Y), m_Value(R)))))
       return false;
 
-    if (!verifyMemoryAccess(Original, TransformedInst, MSSA))
+    // Constant amounts, or one of them the width minus the other
+    if (match(L, m_APInt(C1)) && match(R, m_APInt(C2))) {
+      if (C1->isZero() || C2->isZero() || C1->uge(BW) || C2->uge(BW) ||
+          *C1 + *C2 != BW)
+        return false;
+      Plan.setResult(Plan.intrinsic(Intrinsic::fshl, {X, Y, L}));
+      return true;
+    }
+    if (match(R, m_Sub(m_SpecificInt(BW), m_Specific(L)))) {
+      Plan.setResult(Plan.intrinsic(Intrinsic::fshl, {X, Y, L}));
+      return true;
+    }
+    if (match(L, m_Sub(m_SpecificInt(BW), m_Specific(R)))) {
+      Plan.setResult(Plan.intrinsic(Intrinsic::fshr, {X, Y, R}));
+      return true;
+    }
+
+    // Masked amounts only agree with the funnel shift for a rotate
+    if (X != Y || !isPowerOf2_32(BW))
       return false;
+    auto Masked = [&](auto Amount) {
+      return m_And(Amount, m_SpecificInt(BW - 1));
+    };
+    if (match(L, Masked(m_Value(Amt))) &&
+        match(R, Masked(m_Neg(m_Specific(Amt))))) {
+      Plan.setResult(Plan.intrinsic(Intrinsic::fshl, {X, X, Amt}));
+      return true;
+    }
+    if (match(R, Masked(m_Value(Amt))) &&
+        match(L, Masked(m_Neg(m_Specific(Amt))))) {
+      Plan.setResult(Plan.intrinsic(Intrinsic::fshr, {X, X, Amt}));
+      return true;
+    }
+    return false;
+  }
+};
 
-    if (!verifyDataDependencies(Original, TransformedInst, DepInfo))
+// 50. Remainder of operands that are divided as well -> computed from the
+// quotient, x % y -> x - (x / y) * y, so that both take one division. An
+// unsigned remainder by a power of 2 is left to the mask
+struct RemFromQuotient : RuleBase<Instruction::URem, Instruction::SRem> {
+  static bool apply(Instruction *I, RewritePlan &Plan, RuleContext &Ctx) {
+    bool Signed = I->getOpcode() == Instruction::SRem;
+    const APInt *D;
+    if (!Signed && match(I->getOperand(1), m_APInt(D)) && D->isPowerOf2())
       return false;
+    BinaryOperator *Div = findDivRemPartner(
+        I, Signed ? Instruction::SDiv : Instruction::UDiv, Ctx);
+    if (!Div)
+      return false;
+    auto Product = Plan.binOp(Instruction::Mul, Div, I->getOperand(1));
+    Plan.setResult(Plan.binOp(Instruction::Sub, I->getOperand(0), Product));
+    return true;
+  }
+};
 
-    if (!verifyArithmetic(Original, TransformedInst, SE))
+// Number of bits V is extended from: the source width of a zext, or sext
+// when Signed, the significant bits of a constant, and V's own width for
+// anything else
+static unsigned getSourceWidth(Value *V, bool Signed) {
+  Value *X;
+  const APInt *C;
+  if (Signed ? match(V, m_SExt(m_Value(X))) : match(V, m_ZExt(m_Value(X))))
+    return X->getType()->getScalarSizeInBits();
+  if (match(V, m_APInt(C)))
+    return Signed ? C->getMinSignedBits() : C->getActiveBits();
+  return V->getType()->getScalarSizeInBits();
+}
+
+// 51. Multiply of extended operands that cannot wrap -> the same multiply
+// with nuw or nsw, e.g. zext i32 a * zext i32 b in i64 is nuw. Widening
+// multiplies then look the same whether they come from the source or from
+// the division rules
+struct WideningMulFlags : RuleBase<Instruction::Mul> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    auto *Mul = cast<BinaryOperator>(I);
+    Value *A = Mul->getOperand(0), *B = Mul->getOperand(1);
+    unsigned BW = I->getType()->getScalarSizeInBits();
+    unsigned UnsignedBits = getSourceWidth(A, false) + getSourceWidth(B, false);
+    unsigned SignedBits = getSourceWidth(A, true) + getSourceWidth(B, true);
+    bool NUW = Mul->hasNoUnsignedWrap() || UnsignedBits <= BW;
+    // A product below 2^(BW-1) is non-negative as well
+    bool NSW =
+        Mul->hasNoSignedWrap() || SignedBits <= BW || UnsignedBits < BW;
+    if (NUW == Mul->hasNoUnsignedWrap() && NSW == Mul->hasNoSignedWrap())
       return false;
+    auto Product = Plan.binOp(Instruction::Mul, A, B);
+    Plan.setNoWrapFlags(Product, NUW, NSW);
+    Plan.setResult(Product);
+    return true;
+  }
+};
 
-    if (!verifyExceptions(Original, TransformedInst))
+// 52. High half of a widening multiply done in a type wider than needed ->
+// the multiply in twice the operands' width, the canonical shape the
+// backend selects a multiply-high from, e.g. for i32 a and b
+// (zext a * zext b to i128) >> 32 -> zext ((zext a * zext b to i64) >> 32).
+// A truncation of the high half is folded into the new casts
+struct NarrowMulHigh
+    : RuleBase<Instruction::LShr, Instruction::AShr, Instruction::Trunc> {
+  static bool apply(Instruction *I, RewritePlan &Plan) {
+    auto *Shift = dyn_cast<BinaryOperator>(I);
+    if (isa<TruncInst>(I)) {
+      Shift = dyn_cast<BinaryOperator>(I->getOperand(0));
+      if (!Shift || !Shift->hasOneUse() || !Shift->isShift())
+        return false;
+    }
+    bool Signed = Shift->getOpcode() == Instruction::AShr;
+    Value *A, *B;
+    const APInt *S;
+    if (Shift->getOpcode() == Instruction::Shl ||
+        !match(Shift->getOperand(0),
+               m_OneUse(m_Mul(m_Value(A), m_Value(B)))) ||
+        !match(Shift->getOperand(1), m_APInt(S)))
+      return false;
+    Type *Ty = I->getType();
+    unsigned Half =
+        std::max(getSourceWidth(A, Signed), getSourceWidth(B, Signed));
+    unsigned NarrowBW = std::max<unsigned>(8, PowerOf2Ceil(2 * Half));
+    if (NarrowBW >= Shift->getType()->getScalarSizeInBits() ||
+        S->uge(NarrowBW))
       return false;
 
+    // The product fits the narrow type, so the shift commutes with the
+    // extension back
+    Type *NarrowTy = Ty->getWithNewBitWidth(NarrowBW);
+    auto NarrowA = narrowOperand(Plan, A, NarrowTy);
+    auto NarrowB = narrowOperand(Plan, B, NarrowTy);
+    auto Product = Plan.binOp(Instruction::Mul, NarrowA, NarrowB);
+    Plan.setNoWrapFlags(Product, !Signed, Signed);
+    auto High = Plan.binOp(
+        static_cast<Instruction::BinaryOps>(Shift->getOpcode()), Product,
+        ConstantInt::get(NarrowTy, S->getZExtValue()));
+    unsigned BW = Ty->getScalarSizeInBits();
+    if (BW < NarrowBW)
+      High = Plan.cast(Instruction::Trunc, High, Ty);
+    else if (BW > NarrowBW)
+      High = Plan.cast(Signed ? Instruction::SExt : Instruction::ZExt, High,
+                       Ty);
+    Plan.setResult(High);
     return true;
   }
 };
 
+// Rules are tried in this order; identities come before strength reductions
+// so that e.g. x * 1 folds to x instead of becoming x << 0, and the rules
+// that query known bits, demanded bits or value ranges come last as they
+// cost the most
+using PeepHoleRules =
+    RuleSet<ConstantPropagation, AddZero, SubZero, MulZero, MulOne, UDivOne,
+            SDivOne, XorSelf, AndSelf, OrSelf, NotNot, AndAllOnes, OrZero,
+            NegateZero, CombineCasts, MergeShifts, ShiftPairToMask,
+            DistributeMask, MergeMasks, ReassociateConstants, BalanceTree,
+            MulPow2ToShl, MulByConstantToShiftAdd, UDivPow2ToLShr,
+            UDivByConstant, SDivByConstant, RemFromQuotient, URemByConstant,
+            SRemByConstant, WideningMulFlags, NarrowMulHigh,
+            KnownBitsConstant, DropRedundantMask, DisjointAddToOr,
+            FoldKnownICmp, NarrowUndemanded, NarrowByRange, NarrowICmp,
+            SExtToZExt, DropRedundantTruncExt, CanonicalizeICmp, BoolICmp,
+            InvertICmp, CombineICmps, FoldSelect, FoldPHI, MinMaxToIntrinsic,
+            AbsToIntrinsic, ClampToMinMax, SaturatingSelect, SaturatingClamp,
+            ByteSwap, FunnelShift>;
+
 struct PeepHolePass : public PassInfoMixin<PeepHolePass> {
 private:
   TransformationVerifier Verifier;
-  struct Pattern {
-    std::function<bool(Instruction *)> matcher;
-    std::function<Value *(Instruction *)> replacement;
-    int costDelta;
-  };
+  CostModel Costs;
+  RuleContext Context;
+
+  // Upper bound on the instructions walked when looking for a dead PHI cycle
+  static constexpr unsigned MaxDeadPHICycle = 16;
+
+  // A PHI whose users only feed back into it, e.g. a loop-carried value that
+  // nothing reads, is dead together with those users even though none of
+  // them is use_empty
+  bool isDeadPHICycle(Instruction *I, SmallPtrSetImpl<Instruction *> &Cycle) {
+    if (!isa<PHINode>(I))
+      return false;
 
-  std::vector<Pattern> patterns;
-
-  void initializePatterns() {
-    // 1. Multiply by power of 2 -> Shift left
-    patterns.push_back(
-        {[](Instruction *I) {
-           if (auto *MI = dyn_cast<BinaryOperator>(I)) {
-             if (MI->getOpcode() == Instruction::Mul) {
-               if (auto *CI = dyn_cast<ConstantInt>(MI->getOperand(1))) {
-                 return CI->getValue().isPowerOf2();
-               }
-             }
-           }
-           return false;
-         },
-         [](Instruction *I) {
-           auto *MI = cast<BinaryOperator>(I);
-           IRBuilder<> Builder(I);
-           auto *CI = cast<ConstantInt>(MI->getOperand(1));
-           return Builder.CreateShl(
-               MI->getOperand(0), Builder.getInt32(CI->getValue().logBase2()));
-         },
-         -1});
-
-    // 2. Division by power of 2 -> Shift right
-    patterns.push_back(
-        {[](Instruction *I) {
-           if (auto *DI = dyn_cast<BinaryOperator>(I)) {
-             if (DI->getOpcode() == Instruction::UDiv) {
-               if (auto *CI = dyn_cast<ConstantInt>(DI->getOperand(1))) {
-                 return CI->getValue().isPowerOf2();
-               }
-             }
-           }
-           return false;
-         },
-         [](Instruction *I) {
-           auto *DI = cast<BinaryOperator>(I);
-           IRBuilder<> Builder(I);
-           auto *CI = cast<ConstantInt>(DI->getOperand(1));
-           return Builder.CreateLShr(
-               DI->getOperand(0), Builder.getInt32(CI->getValue().logBase2()));
-         },
-         -2});
-
-    // 3. Add zero elimination
-    patterns.push_back(
-        {[](Instruction *I) {
-           if (auto *AI = dyn_cast<BinaryOperator>(I)) {
-             if (AI->getOpcode() == Instruction::Add) {
-               for (int i = 0; i < 2; i++) {
-                 if (auto *CI = dyn_cast<ConstantInt>(AI->getOperand(i))) {
-                   if (CI->isZero())
-                     return true;
-                 }
-               }
-             }
-           }
-           return false;
-         },
-         [](Instruction *I) {
-           auto *AI = cast<BinaryOperator>(I);
-           return AI->getOperand(isa<ConstantInt>(AI->getOperand(0)) ? 1 : 0);
-         },
-         -1});
-
-    // 4. Multiply by zero -> zero
-    patterns.push_back(
-        {[](Instruction *I) {
-           if (auto *MI = dyn_cast<BinaryOperator>(I)) {
-             if (MI->getOpcode() == Instruction::Mul) {
-               for (int i = 0; i < 2; i++) {
-                 if (auto *CI = dyn_cast<ConstantInt>(MI->getOperand(i))) {
-                   if (CI->isZero())
-                     return true;
-                 }
-               }
-             }
-           }
-           return false;
-         },
-         [](Instruction *I) {
-           IRBuilder<> Builder(I);
-           return Builder.getInt32(0);
-         },
-         -1});
-
-    // 5. XOR with self -> zero
-    patterns.push_back({[](Instruction *I) {
-                          if (auto *XI = dyn_cast<BinaryOperator>(I)) {
-                            if (XI->getOpcode() == Instruction::Xor) {
-                              return XI->getOperand(0) == XI->getOperand(1);
-                            }
-                          }
-                          return false;
-                        },
-                        [](Instruction *I) {
-                          IRBuilder<> Builder(I);
-                          return Builder.getInt32(0);
-                        },
-                        -1});
-
-    // 6. AND with self -> self
-    patterns.push_back({[](Instruction *I) {
-                          if (auto *AI = dyn_cast<BinaryOperator>(I)) {
-                            if (AI->getOpcode() == Instruction::And) {
-                              return AI->getOperand(0) == AI->getOperand(1);
-                            }
-                          }
-                          return false;
-                        },
-                        [](Instruction *I) { return I->getOperand(0); }, -1});
-
-    // 7. OR with self -> self
-    patterns.push_back({[](Instruction *I) {
-                          if (auto *OI = dyn_cast<BinaryOperator>(I)) {
-                            if (OI->getOpcode() == Instruction::Or) {
-                              return OI->getOperand(0) == OI->getOperand(1);
-                            }
-                          }
-                          return false;
-                        },
-                        [](Instruction *I) { return I->getOperand(0); }, -1});
-
-    // 8. NOT NOT -> original
-    patterns.push_back(
-        {[](Instruction *I) {
-           if (auto *NI = dyn_cast<BinaryOperator>(I)) {
-             if (NI->getOpcode() == Instruction::Xor) {
-               if (auto *CI = dyn_cast<ConstantInt>(NI->getOperand(1))) {
-                 if (CI->isAllOnesValue()) {
-                   if (auto *PI = dyn_cast<BinaryOperator>(NI->getOperand(0))) {
-                     if (PI->getOpcode() == Instruction::Xor) {
-                       if (auto *PCI =
-                               dyn_cast<ConstantInt>(PI->getOperand(1))) {
-                         return PCI->isAllOnesValue();
-                       }
-                     }
-                   }
-                 }
-               }
-             }
-           }
-           return false;
-         },
-         [](Instruction *I) {
-           auto *NI = cast<BinaryOperator>(I);
-           auto *PI = cast<BinaryOperator>(NI->getOperand(0));
-           return PI->getOperand(0);
-         },
-         -2});
-
-    // 9. AND with all ones -> self
-    patterns.push_back(
-        {[](Instruction *I) {
-           if (auto *AI = dyn_cast<BinaryOperator>(I)) {
-             if (AI->getOpcode() == Instruction::And) {
-               for (int i = 0; i < 2; i++) {
-                 if (auto *CI = dyn_cast<ConstantInt>(AI->getOperand(i))) {
-                   if (CI->isAllOnesValue())
-                     return true;
-                 }
-               }
-             }
-           }
-           return false;
-         },
-         [](Instruction *I) {
-           auto *AI = cast<BinaryOperator>(I);
-           return AI->getOperand(isa<ConstantInt>(AI->getOperand(0)) ? 1 : 0);
-         },
-         -1});
-
-    // 10. OR with zero -> self
-    patterns.push_back(
-        {[](Instruction *I) {
-           if (auto *OI = dyn_cast<BinaryOperator>(I)) {
-             if (OI->getOpcode() == Instruction::Or) {
-               for (int i = 0; i < 2; i++) {
-                 if (auto *CI = dyn_cast<ConstantInt>(OI->getOperand(i))) {
-                   if (CI->isZero())
-                     return true;
-                 }
-               }
-             }
-           }
-           return false;
-         },
-         [](Instruction *I) {
-           auto *OI = cast<BinaryOperator>(I);
-           return OI->getOperand(isa<ConstantInt>(OI->getOperand(0)) ? 1 : 0);
-         },
-         -1});
-    // 11. Constant Propagation
-    patterns.push_back(
-        {[](Instruction *I) {
-           if (auto *BinOp = dyn_cast<BinaryOperator>(I)) {
-             if (auto *C1 = dyn_cast<ConstantInt>(BinOp->getOperand(0))) {
-               if (auto *C2 = dyn_cast<ConstantInt>(BinOp->getOperand(1))) {
-                 return true;
-               }
-             }
-           }
-           return false;
-         },
-         [](Instruction *I) {
-           auto *BinOp = cast<BinaryOperator>(I);
-           auto *C1 = cast<ConstantInt>(BinOp->getOperand(0));
-           auto *C2 = cast<ConstantInt>(BinOp->getOperand(1));
-           Constant *Folded = nullptr;
-           switch (BinOp->getOpcode()) {
-           case Instruction::Add:
-             Folded = ConstantInt::get(BinOp->getType(),
-                                       C1->getValue() + C2->getValue());
-             break;
-           case Instruction::Sub:
-             Folded = ConstantInt::get(BinOp->getType(),
-                                       C1->getValue() - C2->getValue());
-             break;
-           case Instruction::Mul:
-             Folded = ConstantInt::get(BinOp->getType(),
-                                       C1->getValue() * C2->getValue());
-             break;
-           case Instruction::UDiv:
-             Folded = ConstantInt::get(BinOp->getType(),
-                                       C1->getValue().udiv(C2->getValue()));
-             break;
-           case Instruction::SDiv:
-             Folded = ConstantInt::get(BinOp->getType(),
-                                       C1->getValue().sdiv(C2->getValue()));
-             break;
-           // Add more cases as needed
-           default:
-             break;
-           }
-           return Folded;
-         },
-         -1});
-    // 12. Subtract zero elimination
-    patterns.push_back(
-        {[](Instruction *I) {
-           if (auto *SI = dyn_cast<BinaryOperator>(I)) {
-             if (SI->getOpcode() == Instruction::Sub) {
-               if (auto *CI = dyn_cast<ConstantInt>(SI->getOperand(1))) {
-                 return CI->isZero();
-               }
-             }
-           }
-           return false;
-         },
-         [](Instruction *I) {
-           auto *SI = cast<BinaryOperator>(I);
-           return SI->getOperand(0);
-         },
-         -1});
-
-    // 13. Negate zero
-    patterns.push_back(
-        {[](Instruction *I) {
-           if (auto *SI = dyn_cast<UnaryOperator>(I)) {
-             if (SI->getOpcode() == Instruction::FNeg) {
-               if (auto *CI = dyn_cast<ConstantInt>(SI->getOperand(0))) {
-                 return CI->isZero();
-               }
-             }
-           }
-           return false;
-         },
-         [](Instruction *I) {
-           IRBuilder<> Builder(I);
-           return Builder.getInt32(0);
-         },
-         -1});
-
-    // 14. Multiply by one
-    patterns.push_back(
-        {[](Instruction *I) {
-           if (auto *MI = dyn_cast<BinaryOperator>(I)) {
-             if (MI->getOpcode() == Instruction::Mul) {
-               for (int i = 0; i < 2; i++) {
-                 if (auto *CI = dyn_cast<ConstantInt>(MI->getOperand(i))) {
-                   if (CI->isOne())
-                     return true;
-                 }
-               }
-             }
-           }
-           return false;
-         },
-         [](Instruction *I) {
-           auto *MI = cast<BinaryOperator>(I);
-           return MI->getOperand(isa<ConstantInt>(MI->getOperand(0)) ? 1 : 0);
-         },
-         -1});
-
-    // 15. Divide by one
-    patterns.push_back(
-        {[](Instruction *I) {
-           if (auto *DI = dyn_cast<BinaryOperator>(I)) {
-             if (DI->getOpcode() == Instruction::UDiv ||
-                 DI->getOpcode() == Instruction::SDiv) {
-               if (auto *CI = dyn_cast<ConstantInt>(DI->getOperand(1))) {
-                 return CI->isOne();
-               }
-             }
-           }
-           return false;
-         },
-         [](Instruction *I) {
-           auto *DI = cast<BinaryOperator>(I);
-           return DI->getOperand(0);
-         },
-         -1});
-  }
-  int performDCE(Function &F) {
-    std::vector<Instruction *> toErase;
-
-    for (auto &BB : F) {
-      for (auto &I : BB) {
-        if (I.use_empty() && !I.isTerminator() && !I.mayHaveSideEffects()) {
-          toErase.push_back(&I);
+    SmallVector<Instruction *, 8> Stack{I};
+    Cycle.insert(I);
+    while (!Stack.empty()) {
+      for (User *U : Stack.pop_back_val()->users()) {
+        auto *UserI = cast<Instruction>(U);
+        if (!wouldInstructionBeTriviallyDead(UserI))
+          return false;
+        if (Cycle.insert(UserI).second) {
+          if (Cycle.size() > MaxDeadPHICycle)
+            return false;
+          Stack.push_back(UserI);
         }
       }
     }
+    return true;
+  }
+
+  // Erase I and, transitively, every operand whose last use goes away with
+  // it. Operands that survive have lost a use, which may enable more rules,
+  // so they are re-enqueued. Returns the number of instructions erased
+  int performDCE(Instruction *I, InstructionWorklist &Worklist) {
+    SmallVector<Instruction *, 16> DeadList;
+    SmallPtrSet<Instruction *, 16> Queued;
+    auto enqueueIfDead = [&](Instruction *Candidate) {
+      SmallPtrSet<Instruction *, 8> Cycle;
+      if (isInstructionTriviallyDead(Candidate)) {
+        if (Queued.insert(Candidate).second)
+          DeadList.push_back(Candidate);
+      } else if (isDeadPHICycle(Candidate, Cycle)) {
+        for (Instruction *CycleI : Cycle)
+          if (Queued.insert(CycleI).second)
+            DeadList.push_back(CycleI);
+      } else {
+        return false;
+      }
+      return true;
+    };
 
-    int numInstructionsRemoved = toErase.size();
-    for (auto *I : toErase) {
-      I->eraseFromParent();
+    if (!enqueueIfDead(I))
+      return 0;
+
+    int numInstructionsRemoved = 0;
+    while (!DeadList.empty()) {
+      Instruction *Dead = DeadList.pop_back_val();
+      for (Use &Op : Dead->operands()) {
+        auto *OpI = dyn_cast_or_null<Instruction>(Op.get());
+        Op.set(nullptr);
+        if (OpI && !Queued.count(OpI) && !enqueueIfDead(OpI))
+          Worklist.push(OpI);
+      }
+      // Only members of a dead PHI cycle can still have users here, and
+      // those users are queued for erasure as well
+      if (!Dead->use_empty())
+        Dead->replaceAllUsesWith(PoisonValue::get(Dead->getType()));
+      Worklist.remove(Dead);
+      Dead->eraseFromParent();
+      numInstructionsRemoved++;
     }
     return numInstructionsRemoved;
   }
 
-public:
-  PeepHolePass() { initializePatterns(); }
+  // If BB ends in a branch over a small hammock or diamond, i.e.
+  //   BB -> T -> Merge and BB -> Merge, or BB -> T, F -> Merge,
+  // whose arms are cheap and free of side effects, hoist the arms into BB
+  // and replace the PHIs of Merge with selects on the branch condition. The
+  // arms are left unreachable for removeUnreachableBlocks
+  bool convertToSelects(BasicBlock &BB, DomTreeUpdater &DTU) {
+    auto *BI = dyn_cast<BranchInst>(BB.getTerminator());
+    if (!BI || !BI->isConditional() || isa<Constant>(BI->getCondition()) ||
+        Costs.isPredictable(BI))
+      return false;
+    BasicBlock *Succs[2] = {BI->getSuccessor(0), BI->getSuccessor(1)};
+    if (Succs[0] == Succs[1])
+      return false;
+    // An arm is only entered from BB and falls through to its successor
+    auto isArm = [&](BasicBlock *Arm) {
+      auto *ArmBI = dyn_cast<BranchInst>(Arm->getTerminator());
+      return Arm->getSinglePredecessor() == &BB && ArmBI &&
+             ArmBI->isUnconditional() && !isa<PHINode>(Arm->front());
+    };
+    BasicBlock *Merge;
+    if (isArm(Succs[0]) && Succs[0]->getSingleSuccessor() == Succs[1])
+      Merge = Succs[1];
+    else if (isArm(Succs[1]) && Succs[1]->getSingleSuccessor() == Succs[0])
+      Merge = Succs[0];
+    else if (isArm(Succs[0]) && isArm(Succs[1]) &&
+             Succs[0]->getSingleSuccessor() == Succs[1]->getSingleSuccessor())
+      Merge = Succs[0]->getSingleSuccessor();
+    else
+      return false;
+    if (Merge == &BB)
+      return false;
+
+    // The block each side of the branch enters Merge from
+    BasicBlock *Preds[2];
+    SmallVector<BasicBlock *, 2> Arms;
+    for (unsigned Idx = 0; Idx < 2; ++Idx) {
+      Preds[Idx] = Succs[Idx] == Merge ? &BB : Succs[Idx];
+      if (Preds[Idx] != &BB)
+        Arms.push_back(Preds[Idx]);
+    }
+
+    InstructionCost Cost = 0;
+    for (BasicBlock *Arm : Arms)
+      for (Instruction &I : Arm->instructionsWithoutDebug()) {
+        if (I.isTerminator())
+          continue;
+        if (!isSafeToSpeculativelyExecute(&I))
+          return false;
+        Cost += Costs.getInstructionCost(&I);
+      }
+    Type *CondTy = BI->getCondition()->getType();
+    for (PHINode &PN : Merge->phis()) {
+      Value *TrueV = PN.getIncomingValueForBlock(Preds[0]);
+      Value *FalseV = PN.getIncomingValueForBlock(Preds[1]);
+      if (TrueV != FalseV)
+        Cost += Costs.getSelectCost(PN.getType(), CondTy);
+    }
+    if (!Cost.isValid() || Cost > Costs.getSelectBudget())
+      return false;
+
+    // The arms now run unconditionally: drop what only held on their path
+    for (BasicBlock *Arm : Arms)
+      for (Instruction &I : make_early_inc_range(*Arm)) {
+        if (I.isTerminator())
+          break;
+        if (isa<DbgInfoIntrinsic>(I)) {
+          I.eraseFromParent();
+          continue;
+        }
+        I.dropUndefImplyingAttrsAndUnknownMetadata();
+        I.moveBefore(BI);
+      }
+
+    IRBuilder<> Builder(BI);
+    for (PHINode &PN : Merge->phis()) {
+      Value *TrueV = PN.getIncomingValueForBlock(Preds[0]);
+      Value *FalseV = PN.getIncomingValueForBlock(Preds[1]);
+      Value *V = TrueV == FalseV
+                     ? TrueV
+                     : Builder.CreateSelect(BI->getCondition(), TrueV, FalseV,
+                                            PN.getName() + ".sel");
+      // The entries for the arms go when the arms are removed
+      if (Arms.size() == 2)
+        PN.addIncoming(V, &BB);
+      else
+        PN.setIncomingValueForBlock(&BB, V);
+    }
+
+    SmallVector<DominatorTree::UpdateType, 3> Updates;
+    for (BasicBlock *Arm : Arms)
+      Updates.push_back({DominatorTree::Delete, &BB, Arm});
+    if (Arms.size() == 2)
+      Updates.push_back({DominatorTree::Insert, &BB, Merge});
+    BranchInst::Create(Merge, BI);
+    BI->eraseFromParent();
+    DTU.applyUpdates(Updates);
+    return true;
+  }
+
+  // If H heads a loop that counts the bits of a value, e.g.
+  //   while (x) { x &= x - 1; ++n; }  -> n += ctpop(x)
+  //   while (x) { x >>= 1; ++n; }      -> n += width - ctlz(x)
+  //   while (x) { n += x & 1; x >>= 1; } -> n += ctpop(x)
+  //   while (x) { x <<= 1; ++n; }      -> n += width - cttz(x)
+  // compute the counts with the intrinsic in front of the loop and branch
+  // around it, leaving it unreachable. The loop is the header and a single
+  // body block, the unrotated shape of a while or for loop, and nothing in
+  // it may be used after the loop but the value, which is zero by then,
+  // and the counters
+  bool convertCountLoop(BasicBlock &H, DomTreeUpdater &DTU) {
+    auto *BI = dyn_cast<BranchInst>(H.getTerminator());
+    ICmpInst::Predicate Pred;
+    Value *X;
+    if (!BI || !BI->isConditional() ||
+        !match(BI->getCondition(), m_ICmp(Pred, m_Value(X), m_Zero())) ||
+        !ICmpInst::isEquality(Pred))
+      return false;
+    BasicBlock *Body = BI->getSuccessor(Pred == ICmpInst::ICMP_EQ);
+    BasicBlock *Exit = BI->getSuccessor(Pred != ICmpInst::ICMP_EQ);
+    auto *XPhi = dyn_cast<PHINode>(X);
+    if (!XPhi || XPhi->getParent() != &H || !XPhi->getType()->isIntegerTy() ||
+        Body == &H || Exit == &H || Body->getSinglePredecessor() != &H ||
+        Body->getSingleSuccessor() != &H || XPhi->getNumIncomingValues() != 2)
+      return false;
+    BasicBlock *Preheader =
+        XPhi->getIncomingBlock(XPhi->getIncomingBlock(0) == Body);
+    if (Preheader == Body)
+      return false;
+
+    // How each iteration consumes the value
+    Value *XNext = XPhi->getIncomingValueForBlock(Body);
+    Intrinsic::ID StepIID;
+    if (match(XNext, m_c_And(m_Specific(XPhi),
+                             m_CombineOr(m_Add(m_Specific(XPhi), m_AllOnes()),
+                                         m_Sub(m_Specific(XPhi), m_One())))))
+      StepIID = Intrinsic::ctpop;
+    else if (match(XNext, m_LShr(m_Specific(XPhi), m_One())))
+      StepIID = Intrinsic::ctlz;
+    else if (match(XNext, m_Shl(m_Specific(XPhi), m_One())))
+      StepIID = Intrinsic::cttz;
+    else
+      return false;
+
+    auto isInLoop = [&](User *U) {
+      BasicBlock *BB = cast<Instruction>(U)->getParent();
+      return BB == &H || BB == Body;
+    };
+    auto isUsedAfterLoop = [&](Instruction &I) {
+      return !all_of(I.users(), isInLoop);
+    };
+    // Counters and the intrinsic each one counts with
+    SmallVector<std::pair<PHINode *, Intrinsic::ID>, 2> Counters;
+    for (PHINode &PN : H.phis()) {
+      if (&PN == XPhi || !isUsedAfterLoop(PN))
+        continue;
+      Value *Inc;
+      auto LowBit = m_And(m_Specific(XPhi), m_One());
+      if (!PN.getType()->isIntegerTy() ||
+          !match(PN.getIncomingValueForBlock(Body),
+                 m_c_Add(m_Specific(&PN), m_Value(Inc))))
+        return false;
+      if (match(Inc, m_One()))
+        Counters.push_back({&PN, StepIID});
+      else if (StepIID == Intrinsic::ctlz &&
+               (match(Inc, m_ZExtOrSelf(LowBit)) ||
+                match(Inc, m_Trunc(LowBit))))
+        Counters.push_back({&PN, Intrinsic::ctpop});
+      else
+        return false;
+    }
+    if (Counters.empty())
+      return false;
+
+    InstructionCost IterationCost = 0;
+    for (BasicBlock *BB : {&H, Body})
+      for (Instruction &I : BB->instructionsWithoutDebug()) {
+        if (isa<PHINode>(I) || I.isTerminator())
+          continue;
+        if (I.mayHaveSideEffects() || isUsedAfterLoop(I))
+          return false;
+        IterationCost += Costs.getInstructionCost(&I);
+      }
+    // A loop over the bits runs for half of them on average
+    Type *Ty = XPhi->getType();
+    unsigned BW = Ty->getIntegerBitWidth();
+    for (auto &[Counter, IID] : Counters) {
+      InstructionCost Cost = Costs.getIntrinsicCost(IID, Ty);
+      if (!Cost.isValid() || Cost >= IterationCost * (BW / 2))
+        return false;
+    }
+
+    IRBuilder<> Builder(Preheader->getTerminator());
+    Value *X0 = XPhi->getIncomingValueForBlock(Preheader);
+    SmallDenseMap<unsigned, Value *, 2> Counts;
+    auto getCount = [&](Intrinsic::ID IID) {
+      Value *&Count = Counts[IID];
+      if (Count)
+        return Count;
+      if (IID == Intrinsic::ctpop)
+        return Count = Builder.CreateUnaryIntrinsic(IID, X0);
+      // Leading or trailing zeros are the bits a shift never reaches
+      Value *Zeros = Builder.CreateBinaryIntrinsic(IID, X0, Builder.getFalse());
+      return Count = Builder.CreateSub(ConstantInt::get(Ty, BW), Zeros);
+    };
+    for (auto &[Counter, IID] : Counters) {
+      Value *Start = Counter->getIncomingValueForBlock(Preheader);
+      Value *Final = Builder.CreateAdd(
+          Start, Builder.CreateZExtOrTrunc(getCount(IID), Counter->getType()),
+          Counter->getName() + ".final");
+      Counter->replaceUsesWithIf(
+          Final, [&](Use &U) { return !isInLoop(U.getUser()); });
+    }
+    XPhi->replaceUsesWithIf(Constant::getNullValue(Ty), [&](Use &U) {
+      return !isInLoop(U.getUser());
+    });
 
+    BranchInst::Create(Exit, BI);
+    BI->eraseFromParent();
+    DTU.applyUpdates({{DominatorTree::Delete, &H, Body}});
+    return true;
+  }
+
+  // Fold branches on constant conditions, delete the blocks that become
+  // unreachable and merge the straight-line blocks left behind into their
+  // predecessors. A dominator tree some rule already asked for is kept up
+  // to date along the way, but none is built just for this; every other
+  // analysis is dropped. Returns whether the CFG changed
+  bool foldBranches(Function &F, FunctionAnalysisManager &FAM,
+                    int &numBlocksRemoved) {
+    DomTreeUpdater DTU(FAM.getCachedResult<DominatorTreeAnalysis>(F),
+                       DomTreeUpdater::UpdateStrategy::Lazy);
+    bool changed = false;
+    for (BasicBlock &BB : F) {
+      changed |= ConstantFoldTerminator(&BB, /*DeleteDeadConditions=*/true,
+                                        /*TLI=*/nullptr, &DTU);
+      changed |= convertToSelects(BB, DTU);
+      changed |= convertCountLoop(BB, DTU);
+    }
+    size_t numBlocks = F.size();
+    changed |= removeUnreachableBlocks(F, &DTU);
+    for (BasicBlock &BB : make_early_inc_range(F))
+      changed |= MergeBlockIntoPredecessor(&BB, &DTU);
+    DTU.flush();
+    if (!changed)
+      return false;
+    numBlocksRemoved += numBlocks - F.size();
+
+    PreservedAnalyses PA;
+    PA.preserve<DominatorTreeAnalysis>();
+    FAM.invalidate(F, PA);
+    Verifier.reset(F, FAM);
+    Context.reset(F, FAM, Costs);
+    return true;
+  }
+
+public:
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
     bool changed = false;
     int costDelta = 0;
+    int numInstructionsRemoved = 0;
+    int numBlocksRemoved = 0;
+    bool cfgChanged = false;
+    InstructionWorklist Worklist;
+    Verifier.reset(F, FAM);
+    Costs.reset(F, FAM);
+    Context.reset(F, FAM, Costs);
 
-    for (auto &BB : F) {
-      for (auto &I : BB) {
-        for (const auto &pattern : patterns) {
-          if (pattern.matcher(&I)) {
-            if (Value *replacement = pattern.replacement(&I)) {
-              if (replacement && Verifier.verify(&I, replacement, F, FAM)) {
-                I.replaceAllUsesWith(replacement);
-                changed = true;
-                costDelta += pattern.costDelta;
-              }
-            }
-          }
+    // Folded comparisons turn branches constant, and removing the dead
+    // edges turns PHIs into copies, so alternate between the two until the
+    // CFG stops changing
+    while (true) {
+      // Seed the worklist with every instruction. push() is LIFO, so
+      // walking the function backwards makes the first pop the first
+      // instruction.
+      for (auto &BB : reverse(F))
+        for (auto &I : reverse(BB))
+          Worklist.push(&I);
+
+      // Run to a fixpoint: a successful rewrite only re-enqueues the users
+      // of the replaced value and the operands that lost a use, so chains
+      // like ((x * 1) + 0) | 0 collapse in a single invocation. Dead
+      // instructions are erased as they are popped, which replaces a
+      // separate DCE sweep
+      while (!Worklist.isEmpty()) {
+        // Erased instructions leave a null slot behind
+        Instruction *I = Worklist.removeOne();
+        if (!I)
+          continue;
+        if (int removed = performDCE(I, Worklist)) {
+          numInstructionsRemoved += removed;
+          changed = true;
+          continue;
         }
+
+        PeepHoleRules::apply(I, Context, [&](const RewritePlan &plan) {
+          int delta = 0;
+          if (!Costs.isProfitable(I, plan, delta) ||
+              !Verifier.verify(I, plan))
+            return false;
+
+          SmallVector<Instruction *, 8> newInsts;
+          Value *replacement = plan.materialize(I, newInsts);
+          Worklist.pushUsersToWorkList(*I);
+          // Existing values the plan reads gain users, which rules that look
+          // at users, such as the division ones, may care about
+          for (Instruction *NewI : newInsts) {
+            Worklist.push(NewI);
+            for (Value *Op : NewI->operands())
+              if (auto *OpI = dyn_cast<Instruction>(Op))
+                if (!is_contained(newInsts, OpI))
+                  Worklist.push(OpI);
+          }
+          Worklist.pushValue(replacement);
+          I->replaceAllUsesWith(replacement);
+          numInstructionsRemoved += performDCE(I, Worklist);
+          changed = true;
+          costDelta += delta;
+          return true;
+        });
       }
+      if (!foldBranches(F, FAM, numBlocksRemoved))
+        break;
+      changed = cfgChanged = true;
     }
-    // perform DCE
     if (changed) {
       errs() << "Total cost delta: " << costDelta << '\n';
-      errs() << "Total instructions removed: " << performDCE(F) << '\n';
+      errs() << "Total instructions removed: " << numInstructionsRemoved
+             << '\n';
+      errs() << "Total blocks removed: " << numBlocksRemoved << '\n';
     }
 
-    return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    if (!changed)
+      return PreservedAnalyses::all();
+    // Rewriting instructions leaves the CFG alone, and the CFG phase keeps
+    // the dominator tree up to date
+    PreservedAnalyses PA;
+    if (cfgChanged)
+      PA.preserve<DominatorTreeAnalysis>();
+    else
+      PA.preserveSet<CFGAnalyses>();
+    return PA;
   }
 };
 
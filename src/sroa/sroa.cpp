@@ -1,16 +1,24 @@
 #include "llvm/Transforms/Scalar/SROA.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/AssumptionCache.h"
 #include "llvm/Analysis/MemorySSA.h"
 #include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/IR/PatternMatch.h"
 #include "llvm/Pass.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
@@ -18,9 +26,44 @@
 #include "llvm/Transforms/Utils/PromoteMemToReg.h"
 
 using namespace llvm;
+using namespace llvm::PatternMatch;
 
 namespace {
+// Aggregates with more scalar fields than this are left in memory
+constexpr unsigned MaxLeaves = 64;
+
+// A scalar field of an aggregate alloca. Indices is its path for
+// extractvalue/insertvalue, relative to the type it was collected from
+struct Leaf {
+  uint64_t Offset;
+  Type *Ty;
+  SmallVector<unsigned, 4> Indices;
+};
+
+// An access to an aggregate alloca at a constant byte offset, covering the
+// leaves [First, Last)
+struct Slice {
+  enum AccessKind {
+    Direct,    // Load or store of exactly one leaf
+    Aggregate, // Load or store of a struct or array made of the leaves
+    Integer,   // Load or store of an integer spanning the leaves
+    Vector,    // Load or store of a vector, one leaf per element
+    MemCopy,   // memcpy/memmove into or out of the leaves
+    MemSet     // memset over the leaves
+  };
+
+  Instruction *I;
+  AccessKind Kind;
+  uint64_t Begin;
+  unsigned First, Last;
+  // For MemCopy, whether the alloca is the destination
+  bool IsDest;
+};
+
 class SROA : public PassInfoMixin<SROA> {
+  // Without a dominator tree only allocas that can be promoted by a local
+  // scan are promoted. With one, the tree is still only built when some
+  // alloca needs it
   const bool RequiresDomTree;
 
 public:
@@ -28,9 +71,7 @@ public:
       : RequiresDomTree(RequiresDomTree) {}
 
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
-    auto *DT =
-        RequiresDomTree ? &AM.getResult<DominatorTreeAnalysis>(F) : nullptr;
-    if (!runOnFunction(F, DT))
+    if (!runOnFunction(F, AM))
       return PreservedAnalyses::all();
 
     PreservedAnalyses PA;
@@ -39,63 +80,187 @@ public:
   }
 
 private:
-  bool runOnFunction(Function &F, DominatorTree *DT) {
+  bool runOnFunction(Function &F, FunctionAnalysisManager &AM) {
+    const DataLayout &DL = F.getParent()->getDataLayout();
+    const TargetTransformInfo &TTI = AM.getResult<TargetIRAnalysis>(F);
+
+    // Every fixed-size alloca is a candidate, wherever it lives
+    std::vector<AllocaInst *> Worklist;
+    for (BasicBlock &BB : F)
+      for (Instruction &I : BB)
+        if (AllocaInst *AI = dyn_cast<AllocaInst>(&I))
+          if (isa<ConstantInt>(AI->getArraySize()))
+            Worklist.push_back(AI);
+
     bool Changed = false;
-    // Phase 1: Promote allocas used only as single values
-    Changed |= promoteAllocas(F, DT);
+    while (!Worklist.empty()) {
+      // Phase 1: Split aggregates into one alloca per accessed field, or
+      // turn small arrays into vectors
+      Changed |= splitAggregates(Worklist, DL, TTI);
+
+      // Phase 2: Promote allocas used only as single values
+      Changed |= promoteAllocas(Worklist, F, AM);
+    }
 
     return Changed;
   }
 
-  bool promoteAllocas(Function &F, DominatorTree *DT) {
-    std::vector<AllocaInst *> Allocas;
-    BasicBlock &BB = F.getEntryBlock();
-
-    bool Changed = false;
-    while (1) {
-      Allocas.clear();
-
-      // Find allocas that are safe to promote, by looking at all instructions
-      for (BasicBlock::iterator I = BB.begin(), E = BB.end(); I != E; ++I) {
-        if (AllocaInst *AI = dyn_cast<AllocaInst>(I)) {
-          if (isAllocaPromotable(AI))
-            Allocas.push_back(AI);
-        }
+  // Promote every promotable candidate, locally where the accesses allow
+  // it and with a single PromoteMemToReg call for the rest. Candidates whose
+  // address is stored into a promoted alloca can turn promotable once that
+  // store is gone; those are left in Worklist for another round, everything
+  // else is dropped
+  bool promoteAllocas(std::vector<AllocaInst *> &Worklist, Function &F,
+                      FunctionAnalysisManager &AM) {
+    SmallVector<AllocaInst *, 32> Promotable;
+    SmallPtrSet<AllocaInst *, 32> Promoted;
+    for (AllocaInst *AI : Worklist)
+      if (isAllocaPromotable(AI)) {
+        Promotable.push_back(AI);
+        Promoted.insert(AI);
       }
-      if (Allocas.empty())
-        break;
 
-      // Promote the allocas
-      Changed |= !Allocas.empty();
+    std::vector<AllocaInst *> Deferred;
+    for (AllocaInst *AI : Worklist) {
+      if (Promoted.count(AI))
+        continue;
+      bool StoredIntoPromoted = any_of(AI->users(), [&](User *U) {
+        StoreInst *SI = dyn_cast<StoreInst>(U);
+        return SI && SI->getValueOperand() == AI &&
+               Promoted.count(dyn_cast<AllocaInst>(SI->getPointerOperand()));
+      });
+      if (StoredIntoPromoted)
+        Deferred.push_back(AI);
+    }
+    Worklist = std::move(Deferred);
 
-      SmallVector<AllocaInst *, 32> Worklist(Allocas.begin(), Allocas.end());
-      PromoteMemToReg(Worklist, *DT);
+    // Benign users are only rewritten once the alloca is sure to go, so
+    // one that mysroa-fast leaves alone keeps its lifetime markers and calls
+    bool Changed = false;
+    SmallVector<AllocaInst *, 32> NeedDomTree;
+    for (AllocaInst *AI : Promotable) {
+      BasicBlock *ScanBB = getLocalScanBlock(AI);
+      if (!ScanBB && !RequiresDomTree)
+        continue;
+      removeBenignUsers(AI);
+      Changed = true;
+      if (ScanBB)
+        promoteLocally(AI, ScanBB);
+      else
+        NeedDomTree.push_back(AI);
     }
 
+    if (!NeedDomTree.empty())
+      PromoteMemToReg(NeedDomTree, AM.getResult<DominatorTreeAnalysis>(F));
     return Changed;
   }
 
+  // Return the block a forward scan promotes AI in without a dominator
+  // tree, or null if there is none. This works when every store is in the
+  // alloca's own block, which then dominates every load elsewhere, or when
+  // all accesses are in a single block and none of its loads comes before
+  // a store. A read-only call counts as a load where it is, as that is
+  // where removeBenignUsers loads the value for its copy
+  BasicBlock *getLocalScanBlock(AllocaInst *AI) {
+    BasicBlock *Home = AI->getParent();
+    BasicBlock *Single = nullptr;
+    bool StoresAtHome = true, OneBlock = true;
+    Instruction *First = nullptr;
+    for (User *U : AI->users()) {
+      Instruction *I = cast<Instruction>(U);
+      if (isLifetimeMarker(I) || isa<BitCastInst>(I) ||
+          isa<GetElementPtrInst>(I))
+        continue;
+      BasicBlock *BB = I->getParent();
+      if (isa<StoreInst>(I))
+        StoresAtHome &= BB == Home;
+      OneBlock &= !Single || BB == Single;
+      Single = BB;
+      // The block caches instruction order, so this does not rescan it
+      if (OneBlock && (!First || I->comesBefore(First)))
+        First = I;
+    }
+    if (StoresAtHome)
+      return Home;
+    // Outside the alloca's block, a load before the first store reads what
+    // the previous trip around a loop left behind
+    if (OneBlock && isa<StoreInst>(First))
+      return Single;
+    return nullptr;
+  }
+
+  // Promote an alloca left with only loads and stores by a forward scan of
+  // ScanBB, as found by getLocalScanBlock
+  void promoteLocally(AllocaInst *AI, BasicBlock *ScanBB) {
+    SmallVector<Instruction *, 16> InBlock, Elsewhere;
+    for (User *U : AI->users()) {
+      Instruction *I = cast<Instruction>(U);
+      (I->getParent() == ScanBB ? InBlock : Elsewhere).push_back(I);
+    }
+    llvm::sort(InBlock, [](Instruction *A, Instruction *B) {
+      return A->comesBefore(B);
+    });
+
+    // The variable of a dbg.declare takes each stored value in turn
+    TinyPtrVector<DbgVariableIntrinsic *> Declares = FindDbgAddrUses(AI);
+    DIBuilder DIB(*AI->getModule(), /*AllowUnresolved=*/false);
+
+    Value *Current = UndefValue::get(AI->getAllocatedType());
+    for (Instruction *I : InBlock) {
+      if (StoreInst *SI = dyn_cast<StoreInst>(I)) {
+        Current = SI->getValueOperand();
+        for (DbgVariableIntrinsic *DII : Declares)
+          ConvertDebugDeclareToDebugValue(DII, SI, DIB);
+      } else {
+        I->replaceAllUsesWith(Current);
+      }
+    }
+    for (Instruction *I : Elsewhere)
+      I->replaceAllUsesWith(Current);
+
+    for (Instruction *I : InBlock)
+      I->eraseFromParent();
+    for (Instruction *I : Elsewhere)
+      I->eraseFromParent();
+    for (DbgVariableIntrinsic *DII : Declares)
+      DII->eraseFromParent();
+    AI->eraseFromParent();
+  }
+
   bool isAllocaPromotable(AllocaInst *AI) {
     // Only handle first-class values
     if (!AI->getAllocatedType()->isSized())
       return false;
 
-    // No dynamic allocations
-    if (!AI->isStaticAlloca())
+    // No dynamic or array allocations
+    if (AI->isArrayAllocation())
       return false;
 
     // Check for instructions that make promotion unsafe
     for (User *U : AI->users()) {
       if (LoadInst *LI = dyn_cast<LoadInst>(U)) {
-        if (LI->isVolatile())
+        if (LI->isVolatile() || LI->getType() != AI->getAllocatedType())
           return false;
       } else if (StoreInst *SI = dyn_cast<StoreInst>(U)) {
-        if (SI->isVolatile())
+        if (SI->isVolatile() || SI->getValueOperand() == AI ||
+            SI->getValueOperand()->getType() != AI->getAllocatedType())
+          return false;
+      } else if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(U);
+                 II && II->isLifetimeStartOrEnd()) {
+        // Lifetime markers say nothing about the value
+      } else if (isa<BitCastInst>(U) || isa<GetElementPtrInst>(U)) {
+        // Only casts of the address that feed lifetime markers
+        if (isa<GetElementPtrInst>(U) &&
+            !cast<GetElementPtrInst>(U)->hasAllZeroIndices())
           return false;
-      } else if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(U)) {
-        // Only allow simple GEPs
-        if (!GEP->hasAllConstantIndices())
+        if (!all_of(U->users(), isLifetimeMarker))
           return false;
+      } else if (CallBase *CB = dyn_cast<CallBase>(U)) {
+        // The callee may read the value through the pointer, but neither
+        // write it nor keep the pointer. It gets a copy
+        for (Use &Op : CB->operands())
+          if (Op.get() == AI && !isReadOnlyArgument(CB, Op))
+            return false;
       } else {
         // Unknown instruction
         return false;
@@ -104,6 +269,695 @@ private:
 
     return true;
   }
+
+  static bool isLifetimeMarker(const User *U) {
+    const IntrinsicInst *II = dyn_cast<IntrinsicInst>(U);
+    return II && II->isLifetimeStartOrEnd();
+  }
+
+  static bool isReadOnlyArgument(CallBase *CB, const Use &Op) {
+    if (!CB->isArgOperand(&Op))
+      return false;
+    unsigned ArgNo = CB->getArgOperandNo(&Op);
+    return CB->doesNotCapture(ArgNo) && CB->onlyReadsMemory(ArgNo) &&
+           !CB->isPassPointeeByValueArgument(ArgNo);
+  }
+
+  // Leave only loads and stores on a promotable alloca. Lifetime markers
+  // and the casts feeding them are deleted. A read-only call argument is
+  // pointed at a copy of the value stored right before the call, so the
+  // alloca itself can be promoted
+  void removeBenignUsers(AllocaInst *AI) {
+    AllocaInst *Copy = nullptr;
+    for (Use &U : make_early_inc_range(AI->uses())) {
+      Instruction *I = cast<Instruction>(U.getUser());
+      if (isa<LoadInst>(I) || isa<StoreInst>(I))
+        continue;
+
+      if (CallBase *CB = dyn_cast<CallBase>(I); CB && !isLifetimeMarker(CB)) {
+        if (!Copy)
+          Copy = new AllocaInst(AI->getAllocatedType(),
+                                AI->getType()->getAddressSpace(), nullptr,
+                                AI->getAlign(), AI->getName() + ".copy", AI);
+        IRBuilder<> Builder(CB);
+        Value *V = Builder.CreateAlignedLoad(AI->getAllocatedType(), AI,
+                                             AI->getAlign());
+        Builder.CreateAlignedStore(V, Copy, Copy->getAlign());
+        U.set(Copy);
+        continue;
+      }
+
+      for (User *Marker : make_early_inc_range(I->users()))
+        cast<Instruction>(Marker)->eraseFromParent();
+      I->eraseFromParent();
+    }
+  }
+
+  // Split the aggregates in Worklist, replacing each one that is split by
+  // the allocas of its fields or by a vector alloca. Splitting rewrites
+  // copies from or to other allocas into field accesses, which may let an
+  // alloca that could not be split before go through, so those are retried
+  bool splitAggregates(std::vector<AllocaInst *> &Worklist,
+                       const DataLayout &DL, const TargetTransformInfo &TTI) {
+    std::vector<AllocaInst *> Scalars;
+    SmallVector<AllocaInst *, 16> Pending;
+    for (AllocaInst *AI : Worklist) {
+      if (AI->getAllocatedType()->isAggregateType())
+        Pending.push_back(AI);
+      else
+        Scalars.push_back(AI);
+    }
+    std::reverse(Pending.begin(), Pending.end());
+
+    bool Changed = false;
+    SmallSetVector<AllocaInst *, 8> Unsplit;
+    while (!Pending.empty()) {
+      AllocaInst *AI = Pending.pop_back_val();
+      SmallVector<AllocaInst *, 4> Partners;
+      if (!vectorizeAlloca(AI, DL, TTI, Scalars, Partners) &&
+          !splitAlloca(AI, DL, Scalars, Partners)) {
+        Unsplit.insert(AI);
+        continue;
+      }
+      Changed = true;
+      for (AllocaInst *Partner : Partners)
+        if (Unsplit.remove(Partner))
+          Pending.push_back(Partner);
+    }
+
+    // An aggregate that stays whole can still be promoted as a single value
+    Scalars.insert(Scalars.end(), Unsplit.begin(), Unsplit.end());
+    Worklist = std::move(Scalars);
+    return Changed;
+  }
+
+  // Replace a small array alloca with a single vector alloca when a vector
+  // register of the target holds the whole array. Element accesses, at a
+  // constant or a variable index, become extractelement/insertelement on the
+  // vector. Every access has to be to one element of the element type or to
+  // the array as a whole
+  bool vectorizeAlloca(AllocaInst *AI, const DataLayout &DL,
+                       const TargetTransformInfo &TTI,
+                       std::vector<AllocaInst *> &NewAllocas,
+                       SmallVectorImpl<AllocaInst *> &Partners) {
+    ArrayType *AT = dyn_cast<ArrayType>(AI->getAllocatedType());
+    if (!AT || AI->isArrayAllocation() || AT->getNumElements() < 2)
+      return false;
+    Type *EltTy = AT->getElementType();
+    if (!VectorType::isValidElementType(EltTy) || !isByteSized(EltTy, DL) ||
+        DL.getTypeAllocSize(EltTy) != DL.getTypeStoreSize(EltTy))
+      return false;
+    FixedVectorType *VecTy = FixedVectorType::get(EltTy, AT->getNumElements());
+    TypeSize RegisterBits =
+        TTI.getRegisterBitWidth(TargetTransformInfo::RGK_FixedWidthVector);
+    if (DL.getTypeSizeInBits(VecTy).getFixedSize() >
+        RegisterBits.getFixedSize())
+      return false;
+
+    uint64_t EltSize = DL.getTypeStoreSize(EltTy).getFixedSize();
+    uint64_t ArraySize = EltSize * AT->getNumElements();
+    Type *IndexTy = DL.getIndexType(AI->getType());
+
+    // Index is null for an access to the whole array
+    struct ElementAccess {
+      Instruction *I;
+      Value *Index;
+      bool IsDest;
+    };
+    SmallVector<ElementAccess, 16> Accesses;
+    SmallVector<Instruction *, 16> Pointers;
+    SmallVector<std::pair<Instruction *, Value *>, 16> Worklist;
+    Worklist.push_back({AI, nullptr});
+    while (!Worklist.empty()) {
+      auto [Ptr, Index] = Worklist.pop_back_val();
+      for (Use &U : Ptr->uses()) {
+        Instruction *I = cast<Instruction>(U.getUser());
+        if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(I)) {
+          // Element addresses are only formed from the array itself
+          if (Index)
+            return false;
+          APInt Offset(DL.getIndexTypeSizeInBits(GEP->getType()), 0);
+          if (GEP->accumulateConstantOffset(DL, Offset)) {
+            if (Offset.isNegative() || Offset.urem(EltSize) != 0 ||
+                Offset.udiv(EltSize).uge(AT->getNumElements()))
+              return false;
+            Index = ConstantInt::get(IndexTy, Offset.udiv(EltSize));
+          } else if (GEP->getSourceElementType() == AT &&
+                     GEP->getNumIndices() == 2 &&
+                     match(GEP->getOperand(1), m_Zero())) {
+            Index = GEP->getOperand(2);
+          } else {
+            return false;
+          }
+          Pointers.push_back(GEP);
+          Worklist.push_back({GEP, Index});
+          Index = nullptr;
+        } else if (BitCastInst *BC = dyn_cast<BitCastInst>(I)) {
+          if (Index)
+            return false;
+          Pointers.push_back(BC);
+          Worklist.push_back({BC, nullptr});
+        } else if (isLifetimeMarker(I)) {
+          Pointers.push_back(I);
+        } else if (isa<LoadInst>(I) || isa<StoreInst>(I)) {
+          LoadInst *LI = dyn_cast<LoadInst>(I);
+          StoreInst *SI = dyn_cast<StoreInst>(I);
+          if (LI ? !LI->isSimple()
+                 : !SI->isSimple() || U.getOperandNo() !=
+                                          StoreInst::getPointerOperandIndex())
+            return false;
+          Type *Ty = LI ? LI->getType() : SI->getValueOperand()->getType();
+          Value *At = Index;
+          if (!At && Ty == EltTy)
+            At = ConstantInt::get(IndexTy, 0);
+          if (At ? Ty != EltTy : Ty != AT && Ty != VecTy)
+            return false;
+          Accesses.push_back({I, At, false});
+        } else if (MemIntrinsic *MI = dyn_cast<MemIntrinsic>(I)) {
+          ConstantInt *Length = dyn_cast<ConstantInt>(MI->getLength());
+          if (Index || MI->isVolatile() || !Length ||
+              Length->getZExtValue() != ArraySize)
+            return false;
+          if (MemSetInst *MS = dyn_cast<MemSetInst>(MI)) {
+            ConstantInt *Byte = dyn_cast<ConstantInt>(MS->getValue());
+            if (!Byte || !getSplat(VecTy, Byte->getZExtValue(), DL))
+              return false;
+          } else if (any_of(Accesses, [&](const ElementAccess &A) {
+                       return A.I == MI;
+                     })) {
+            // A copy within the array itself
+            return false;
+          }
+          Accesses.push_back({MI, nullptr, U.getOperandNo() == 0});
+        } else {
+          // Unknown instruction
+          return false;
+        }
+      }
+    }
+
+    AllocaInst *VecAI =
+        new AllocaInst(VecTy, AI->getType()->getAddressSpace(), nullptr,
+                       AI->getAlign(), AI->getName() + ".vec", AI);
+    NewAllocas.push_back(VecAI);
+    for (const ElementAccess &A : Accesses) {
+      IRBuilder<> Builder(A.I);
+      auto LoadVector = [&]() -> Value * {
+        return Builder.CreateAlignedLoad(VecTy, VecAI, VecAI->getAlign());
+      };
+      auto StoreVector = [&](Value *V) {
+        Builder.CreateAlignedStore(V, VecAI, VecAI->getAlign());
+      };
+
+      if (LoadInst *LI = dyn_cast<LoadInst>(A.I)) {
+        Value *V = LoadVector();
+        if (A.Index) {
+          V = Builder.CreateExtractElement(V, A.Index);
+        } else if (LI->getType() == AT) {
+          Value *Array = PoisonValue::get(AT);
+          for (unsigned Idx = 0; Idx != AT->getNumElements(); ++Idx)
+            Array = Builder.CreateInsertValue(
+                Array, Builder.CreateExtractElement(V, Idx), Idx);
+          V = Array;
+        }
+        LI->replaceAllUsesWith(V);
+      } else if (StoreInst *SI = dyn_cast<StoreInst>(A.I)) {
+        Value *V = SI->getValueOperand();
+        if (A.Index) {
+          V = Builder.CreateInsertElement(LoadVector(), V, A.Index);
+        } else if (V->getType() == AT) {
+          Value *Array = V;
+          V = PoisonValue::get(VecTy);
+          for (unsigned Idx = 0; Idx != AT->getNumElements(); ++Idx)
+            V = Builder.CreateInsertElement(
+                V, Builder.CreateExtractValue(Array, Idx), Idx);
+        }
+        StoreVector(V);
+      } else if (MemSetInst *MS = dyn_cast<MemSetInst>(A.I)) {
+        uint8_t Byte = cast<ConstantInt>(MS->getValue())->getZExtValue();
+        StoreVector(getSplat(VecTy, Byte, DL));
+      } else {
+        MemTransferInst *MT = cast<MemTransferInst>(A.I);
+        Value *Other = A.IsDest ? MT->getRawSource() : MT->getRawDest();
+        Value *Ptr = Builder.CreateBitCast(
+            Other,
+            VecTy->getPointerTo(Other->getType()->getPointerAddressSpace()));
+        if (A.IsDest)
+          StoreVector(Builder.CreateAlignedLoad(
+              VecTy, Ptr, MT->getSourceAlign().valueOrOne()));
+        else
+          Builder.CreateAlignedStore(LoadVector(), Ptr,
+                                     MT->getDestAlign().valueOrOne());
+        if (AllocaInst *Partner =
+                dyn_cast<AllocaInst>(getUnderlyingObject(Other)))
+          Partners.push_back(Partner);
+      }
+      A.I->eraseFromParent();
+    }
+
+    // The vector has the layout of the array, so debug info carries over
+    for (DbgVariableIntrinsic *DII : FindDbgAddrUses(AI))
+      DII->replaceVariableLocationOp(AI, VecAI);
+
+    // Address computations and lifetime markers, users before definitions
+    for (Instruction *Ptr : reverse(Pointers))
+      Ptr->eraseFromParent();
+    AI->eraseFromParent();
+    return true;
+  }
+
+  // Replace an aggregate alloca with one alloca per field that is accessed,
+  // appending those to NewAllocas. Every use has to resolve to a constant
+  // offset that lines up with fields. Allocas on the other end of a copy
+  // that was rewritten go to Partners
+  bool splitAlloca(AllocaInst *AI, const DataLayout &DL,
+                   std::vector<AllocaInst *> &NewAllocas,
+                   SmallVectorImpl<AllocaInst *> &Partners) {
+    if (AI->isArrayAllocation())
+      return false;
+
+    SmallVector<Leaf, 16> Leaves;
+    SmallVector<unsigned, 4> Path;
+    if (!collectLeaves(AI->getAllocatedType(), 0, DL, Path, Leaves))
+      return false;
+
+    SmallVector<Slice, 16> Slices;
+    SmallVector<Instruction *, 16> Pointers;
+    if (!collectSlices(AI, Leaves, DL, Slices, Pointers))
+      return false;
+
+    // Fields that are never accessed get no alloca at all
+    SmallVector<AllocaInst *, 16> FieldAllocas(Leaves.size(), nullptr);
+    for (const Slice &S : Slices) {
+      for (unsigned Idx = S.First; Idx != S.Last; ++Idx) {
+        if (FieldAllocas[Idx])
+          continue;
+        const Leaf &L = Leaves[Idx];
+        FieldAllocas[Idx] = new AllocaInst(
+            L.Ty, AI->getType()->getAddressSpace(), nullptr,
+            commonAlignment(AI->getAlign(), L.Offset),
+            AI->getName() + ".sroa." + Twine(Idx), AI);
+        NewAllocas.push_back(FieldAllocas[Idx]);
+      }
+
+      if (MemTransferInst *MT = dyn_cast<MemTransferInst>(S.I)) {
+        Value *Other = S.IsDest ? MT->getRawSource() : MT->getRawDest();
+        if (AllocaInst *Partner =
+                dyn_cast<AllocaInst>(getUnderlyingObject(Other)))
+          Partners.push_back(Partner);
+      }
+    }
+
+    for (const Slice &S : Slices)
+      rewriteSlice(S, Leaves, FieldAllocas, DL);
+    splitDbgDeclares(AI, Leaves, FieldAllocas, DL);
+
+    // The address computations and lifetime markers are dead now, users
+    // before definitions
+    for (Instruction *Ptr : reverse(Pointers))
+      Ptr->eraseFromParent();
+    AI->eraseFromParent();
+    return true;
+  }
+
+  // Describe the variable of each dbg.declare on AI by one fragment per
+  // field alloca
+  static void splitDbgDeclares(AllocaInst *AI, ArrayRef<Leaf> Leaves,
+                               ArrayRef<AllocaInst *> FieldAllocas,
+                               const DataLayout &DL) {
+    TinyPtrVector<DbgVariableIntrinsic *> Declares = FindDbgAddrUses(AI);
+    if (Declares.empty())
+      return;
+
+    DIBuilder DIB(*AI->getModule(), /*AllowUnresolved=*/false);
+    uint64_t AllocaBits = DL.getTypeSizeInBits(AI->getAllocatedType());
+    for (DbgVariableIntrinsic *DII : Declares) {
+      DILocalVariable *Var = DII->getVariable();
+      uint64_t VarBits = Var->getSizeInBits().getValueOr(AllocaBits);
+      for (unsigned Idx = 0; Idx != Leaves.size(); ++Idx) {
+        if (!FieldAllocas[Idx])
+          continue;
+        uint64_t OffsetBits = 8 * Leaves[Idx].Offset;
+        uint64_t SizeBits = DL.getTypeSizeInBits(Leaves[Idx].Ty);
+        if (OffsetBits + SizeBits > VarBits)
+          continue;
+        Optional<DIExpression *> Expr = DII->getExpression();
+        if (SizeBits != VarBits)
+          Expr = DIExpression::createFragmentExpression(*Expr, OffsetBits,
+                                                        SizeBits);
+        if (Expr)
+          DIB.insertDeclare(FieldAllocas[Idx], Var, *Expr,
+                            DII->getDebugLoc(), DII);
+      }
+      DII->eraseFromParent();
+    }
+  }
+
+  // Flatten Ty, placed at Offset, into its scalar fields in offset order
+  static bool collectLeaves(Type *Ty, uint64_t Offset, const DataLayout &DL,
+                            SmallVectorImpl<unsigned> &Path,
+                            SmallVectorImpl<Leaf> &Leaves) {
+    if (StructType *ST = dyn_cast<StructType>(Ty)) {
+      const StructLayout *SL = DL.getStructLayout(ST);
+      for (unsigned Idx = 0, E = ST->getNumElements(); Idx != E; ++Idx) {
+        Path.push_back(Idx);
+        bool Collected =
+            collectLeaves(ST->getElementType(Idx),
+                          Offset + SL->getElementOffset(Idx), DL, Path, Leaves);
+        Path.pop_back();
+        if (!Collected)
+          return false;
+      }
+      return true;
+    }
+
+    if (ArrayType *AT = dyn_cast<ArrayType>(Ty)) {
+      if (AT->getNumElements() > MaxLeaves)
+        return false;
+      uint64_t Size = DL.getTypeAllocSize(AT->getElementType());
+      for (unsigned Idx = 0, E = AT->getNumElements(); Idx != E; ++Idx) {
+        Path.push_back(Idx);
+        bool Collected = collectLeaves(AT->getElementType(),
+                                       Offset + Idx * Size, DL, Path, Leaves);
+        Path.pop_back();
+        if (!Collected)
+          return false;
+      }
+      return true;
+    }
+
+    if (Leaves.size() == MaxLeaves || !Ty->isSingleValueType() ||
+        isa<ScalableVectorType>(Ty))
+      return false;
+    Leaves.push_back({Offset, Ty, {Path.begin(), Path.end()}});
+    return true;
+  }
+
+  static uint64_t getLeafEnd(const Leaf &L, const DataLayout &DL) {
+    return L.Offset + DL.getTypeStoreSize(L.Ty).getFixedSize();
+  }
+
+  // Find the leaves [First, Last) inside [Begin, End). Fails if a leaf
+  // straddles either end
+  static bool findLeaves(ArrayRef<Leaf> Leaves, uint64_t Begin, uint64_t End,
+                         const DataLayout &DL, unsigned &First,
+                         unsigned &Last) {
+    auto Before = [](const Leaf &L, uint64_t Offset) {
+      return L.Offset < Offset;
+    };
+    First = lower_bound(Leaves, Begin, Before) - Leaves.begin();
+    Last = lower_bound(Leaves, End, Before) - Leaves.begin();
+    if (First != 0 && getLeafEnd(Leaves[First - 1], DL) > Begin)
+      return false;
+    return First == Last || getLeafEnd(Leaves[Last - 1], DL) <= End;
+  }
+
+  // Whether the leaves [First, Last) tile [Begin, End) without padding
+  static bool isContiguous(ArrayRef<Leaf> Leaves, uint64_t Begin,
+                           uint64_t End, unsigned First, unsigned Last,
+                           const DataLayout &DL) {
+    if (First == Last || Leaves[First].Offset != Begin ||
+        getLeafEnd(Leaves[Last - 1], DL) != End)
+      return false;
+    for (unsigned Idx = First + 1; Idx != Last; ++Idx)
+      if (getLeafEnd(Leaves[Idx - 1], DL) != Leaves[Idx].Offset)
+        return false;
+    return true;
+  }
+
+  // Whether Ty is made of whole bytes, so it can be spliced into an integer
+  static bool isByteSized(Type *Ty, const DataLayout &DL) {
+    return DL.getTypeSizeInBits(Ty) == DL.getTypeStoreSizeInBits(Ty);
+  }
+
+  // Walk every use of the alloca through GEPs and bitcasts, recording the
+  // accesses. Fails on anything that is not a simple access at a constant
+  // offset lining up with the leaves
+  bool collectSlices(AllocaInst *AI, ArrayRef<Leaf> Leaves,
+                     const DataLayout &DL, SmallVectorImpl<Slice> &Slices,
+                     SmallVectorImpl<Instruction *> &Pointers) {
+    SmallVector<std::pair<Instruction *, uint64_t>, 16> Worklist;
+    SmallPtrSet<Instruction *, 4> Transfers;
+    Worklist.push_back({AI, 0});
+    while (!Worklist.empty()) {
+      auto [Ptr, Offset] = Worklist.pop_back_val();
+      for (Use &U : Ptr->uses()) {
+        Instruction *I = cast<Instruction>(U.getUser());
+        if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(I)) {
+          APInt GEPOffset(DL.getIndexTypeSizeInBits(GEP->getType()), 0);
+          if (!GEP->accumulateConstantOffset(DL, GEPOffset))
+            return false;
+          int64_t NewOffset = int64_t(Offset) + GEPOffset.getSExtValue();
+          if (NewOffset < 0)
+            return false;
+          Pointers.push_back(GEP);
+          Worklist.push_back({GEP, uint64_t(NewOffset)});
+        } else if (BitCastInst *BC = dyn_cast<BitCastInst>(I)) {
+          Pointers.push_back(BC);
+          Worklist.push_back({BC, Offset});
+        } else if (isLifetimeMarker(I)) {
+          Pointers.push_back(I);
+        } else if (LoadInst *LI = dyn_cast<LoadInst>(I)) {
+          if (!LI->isSimple() ||
+              !addTypedSlice(LI, LI->getType(), Offset, Leaves, DL, Slices))
+            return false;
+        } else if (StoreInst *SI = dyn_cast<StoreInst>(I)) {
+          if (!SI->isSimple() ||
+              U.getOperandNo() != StoreInst::getPointerOperandIndex() ||
+              !addTypedSlice(SI, SI->getValueOperand()->getType(), Offset,
+                             Leaves, DL, Slices))
+            return false;
+        } else if (MemIntrinsic *MI = dyn_cast<MemIntrinsic>(I)) {
+          ConstantInt *Length = dyn_cast<ConstantInt>(MI->getLength());
+          if (MI->isVolatile() || !Length)
+            return false;
+          uint64_t End = Offset + Length->getZExtValue();
+          unsigned First, Last;
+          if (!findLeaves(Leaves, Offset, End, DL, First, Last))
+            return false;
+
+          if (MemSetInst *MS = dyn_cast<MemSetInst>(MI)) {
+            ConstantInt *Byte = dyn_cast<ConstantInt>(MS->getValue());
+            if (!Byte)
+              return false;
+            for (unsigned Idx = First; Idx != Last; ++Idx)
+              if (!getSplat(Leaves[Idx].Ty, Byte->getZExtValue(), DL))
+                return false;
+            Slices.push_back({MI, Slice::MemSet, Offset, First, Last, true});
+            continue;
+          }
+
+          // A copy within the alloca itself would need both ends rewritten
+          // at once. Bytes copied into padding can be dropped, but a copy
+          // out of the alloca has to reproduce every byte
+          bool IsDest = U.getOperandNo() == 0;
+          if (!Transfers.insert(MI).second ||
+              (!IsDest && !isContiguous(Leaves, Offset, End, First, Last, DL)))
+            return false;
+          Slices.push_back(
+              {MI, Slice::MemCopy, Offset, First, Last, IsDest});
+        } else {
+          // Unknown instruction
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // Classify a load or store of Ty at Begin
+  static bool addTypedSlice(Instruction *I, Type *Ty, uint64_t Begin,
+                            ArrayRef<Leaf> Leaves, const DataLayout &DL,
+                            SmallVectorImpl<Slice> &Slices) {
+    if (isa<ScalableVectorType>(Ty))
+      return false;
+    uint64_t End = Begin + DL.getTypeStoreSize(Ty).getFixedSize();
+    unsigned First, Last;
+    if (!findLeaves(Leaves, Begin, End, DL, First, Last) || First == Last)
+      return false;
+
+    Slice S{I, Slice::Direct, Begin, First, Last, false};
+    if (Last - First == 1 && Leaves[First].Offset == Begin &&
+        Leaves[First].Ty == Ty) {
+      Slices.push_back(S);
+      return true;
+    }
+
+    // A whole sub-aggregate has to consist of exactly these leaves
+    if (Ty->isAggregateType()) {
+      SmallVector<Leaf, 16> Parts;
+      SmallVector<unsigned, 4> Path;
+      if (!collectLeaves(Ty, Begin, DL, Path, Parts) ||
+          Parts.size() != Last - First)
+        return false;
+      for (unsigned Idx = 0; Idx != Parts.size(); ++Idx)
+        if (Parts[Idx].Offset != Leaves[First + Idx].Offset ||
+            Parts[Idx].Ty != Leaves[First + Idx].Ty)
+          return false;
+      S.Kind = Slice::Aggregate;
+      Slices.push_back(S);
+      return true;
+    }
+
+    if (!isContiguous(Leaves, Begin, End, First, Last, DL))
+      return false;
+
+    // An integer spanning several fields, e.g. a struct passed in a register
+    if (Ty->isIntegerTy() && DL.isLittleEndian() && isByteSized(Ty, DL)) {
+      for (unsigned Idx = First; Idx != Last; ++Idx) {
+        Type *LeafTy = Leaves[Idx].Ty;
+        if (!(LeafTy->isIntegerTy() || LeafTy->isFloatingPointTy()) ||
+            !isByteSized(LeafTy, DL))
+          return false;
+      }
+      S.Kind = Slice::Integer;
+      Slices.push_back(S);
+      return true;
+    }
+
+    FixedVectorType *VT = dyn_cast<FixedVectorType>(Ty);
+    if (!VT || VT->getNumElements() != Last - First ||
+        !isByteSized(VT->getElementType(), DL))
+      return false;
+    for (unsigned Idx = First; Idx != Last; ++Idx)
+      if (Leaves[Idx].Ty != VT->getElementType())
+        return false;
+    S.Kind = Slice::Vector;
+    Slices.push_back(S);
+    return true;
+  }
+
+  // The value of Ty whose every byte is Byte, if there is one
+  static Constant *getSplat(Type *Ty, uint8_t Byte, const DataLayout &DL) {
+    if (Byte == 0)
+      return Constant::getNullValue(Ty);
+    if (!isByteSized(Ty, DL))
+      return nullptr;
+    if (IntegerType *IT = dyn_cast<IntegerType>(Ty))
+      return ConstantInt::get(
+          IT, APInt::getSplat(IT->getBitWidth(), APInt(8, Byte)));
+    if (Ty->isFloatingPointTy()) {
+      Type *IntTy = IntegerType::get(Ty->getContext(),
+                                     DL.getTypeSizeInBits(Ty).getFixedSize());
+      return ConstantExpr::getBitCast(getSplat(IntTy, Byte, DL), Ty);
+    }
+    if (FixedVectorType *VT = dyn_cast<FixedVectorType>(Ty))
+      if (Constant *Elt = getSplat(VT->getElementType(), Byte, DL))
+        return ConstantVector::getSplat(VT->getElementCount(), Elt);
+    return nullptr;
+  }
+
+  void rewriteSlice(const Slice &S, ArrayRef<Leaf> Leaves,
+                    ArrayRef<AllocaInst *> NewAllocas, const DataLayout &DL) {
+    IRBuilder<> Builder(S.I);
+    auto LoadLeaf = [&](unsigned Idx) -> Value * {
+      AllocaInst *NewAI = NewAllocas[Idx];
+      return Builder.CreateAlignedLoad(Leaves[Idx].Ty, NewAI,
+                                       NewAI->getAlign());
+    };
+    auto StoreLeaf = [&](Value *V, unsigned Idx) {
+      AllocaInst *NewAI = NewAllocas[Idx];
+      Builder.CreateAlignedStore(V, NewAI, NewAI->getAlign());
+    };
+
+    LoadInst *LI = dyn_cast<LoadInst>(S.I);
+    StoreInst *SI = dyn_cast<StoreInst>(S.I);
+    Type *Ty = LI ? LI->getType() : SI ? SI->getValueOperand()->getType()
+                                       : nullptr;
+    Value *V = LI ? nullptr : SI ? SI->getValueOperand() : nullptr;
+
+    switch (S.Kind) {
+    case Slice::Direct:
+      S.I->setOperand(LI ? LoadInst::getPointerOperandIndex()
+                         : StoreInst::getPointerOperandIndex(),
+                      NewAllocas[S.First]);
+      return;
+
+    case Slice::Aggregate: {
+      SmallVector<Leaf, 16> Parts;
+      SmallVector<unsigned, 4> Path;
+      collectLeaves(Ty, S.Begin, DL, Path, Parts);
+      if (LI)
+        V = PoisonValue::get(Ty);
+      for (unsigned Idx = S.First; Idx != S.Last; ++Idx) {
+        ArrayRef<unsigned> Indices = Parts[Idx - S.First].Indices;
+        if (LI)
+          V = Builder.CreateInsertValue(V, LoadLeaf(Idx), Indices);
+        else
+          StoreLeaf(Builder.CreateExtractValue(V, Indices), Idx);
+      }
+      break;
+    }
+
+    case Slice::Integer:
+      // Little endian: the first field is the low bits
+      for (unsigned Idx = S.First; Idx != S.Last; ++Idx) {
+        Type *LeafTy = Leaves[Idx].Ty;
+        Type *LeafIntTy = Builder.getIntNTy(DL.getTypeSizeInBits(LeafTy));
+        uint64_t Shift = 8 * (Leaves[Idx].Offset - S.Begin);
+        if (LI) {
+          Value *Elt = Builder.CreateBitCast(LoadLeaf(Idx), LeafIntTy);
+          Elt = Builder.CreateZExt(Elt, Ty);
+          if (Shift)
+            Elt = Builder.CreateShl(Elt, Shift);
+          V = V ? Builder.CreateOr(V, Elt) : Elt;
+        } else {
+          Value *Elt = Shift ? Builder.CreateLShr(V, Shift) : V;
+          Elt = Builder.CreateTrunc(Elt, LeafIntTy);
+          StoreLeaf(Builder.CreateBitCast(Elt, LeafTy), Idx);
+        }
+      }
+      break;
+
+    case Slice::Vector:
+      if (LI)
+        V = PoisonValue::get(Ty);
+      for (unsigned Idx = S.First; Idx != S.Last; ++Idx) {
+        uint64_t Lane = Idx - S.First;
+        if (LI)
+          V = Builder.CreateInsertElement(V, LoadLeaf(Idx), Lane);
+        else
+          StoreLeaf(Builder.CreateExtractElement(V, Lane), Idx);
+      }
+      break;
+
+    case Slice::MemCopy: {
+      // Copy field by field from or to the other side, addressed in bytes
+      MemTransferInst *MT = cast<MemTransferInst>(S.I);
+      Value *Other = S.IsDest ? MT->getRawSource() : MT->getRawDest();
+      Align OtherAlign =
+          (S.IsDest ? MT->getSourceAlign() : MT->getDestAlign()).valueOrOne();
+      unsigned AS = Other->getType()->getPointerAddressSpace();
+      for (unsigned Idx = S.First; Idx != S.Last; ++Idx) {
+        Type *LeafTy = Leaves[Idx].Ty;
+        uint64_t Delta = Leaves[Idx].Offset - S.Begin;
+        Value *Ptr = Other;
+        if (Delta)
+          Ptr = Builder.CreateConstInBoundsGEP1_64(Builder.getInt8Ty(), Ptr,
+                                                   Delta);
+        Ptr = Builder.CreateBitCast(Ptr, LeafTy->getPointerTo(AS));
+        Align PtrAlign = commonAlignment(OtherAlign, Delta);
+        if (S.IsDest)
+          StoreLeaf(Builder.CreateAlignedLoad(LeafTy, Ptr, PtrAlign), Idx);
+        else
+          Builder.CreateAlignedStore(LoadLeaf(Idx), Ptr, PtrAlign);
+      }
+      break;
+    }
+
+    case Slice::MemSet: {
+      uint8_t Byte =
+          cast<ConstantInt>(cast<MemSetInst>(S.I)->getValue())->getZExtValue();
+      for (unsigned Idx = S.First; Idx != S.Last; ++Idx)
+        StoreLeaf(getSplat(Leaves[Idx].Ty, Byte, DL), Idx);
+      break;
+    }
+    }
+
+    if (LI)
+      LI->replaceAllUsesWith(V);
+    S.I->eraseFromParent();
+  }
 };
 } // namespace
 
@@ -118,6 +972,10 @@ llvmGetPassPluginInfo() {
                     FPM.addPass(SROA());
                     return true;
                   }
+                  if (Name == "mysroa-fast") {
+                    FPM.addPass(SROA(/*RequiresDomTree=*/false));
+                    return true;
+                  }
                   return false;
                 });
           }};
@@ -0,0 +1,50 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Packing fields the way serialization code does
+uint32_t test_pack(uint32_t lo, uint32_t hi) {
+  uint32_t a = lo & 0xFF;        // low byte
+  uint32_t b = (hi & 0xFF) << 8; // next byte, no bits in common with a
+  uint32_t c = (a + b) & 0xFFFF; // -> a | b, the mask clears nothing
+  uint32_t d = (c >> 4) << 4;    // -> c & -16
+  return d | (a & 0xF);          // -> (c & -16) | (lo & 0xF)
+}
+
+// Only the low byte of the arithmetic is ever stored
+uint8_t test_narrow(uint8_t x, uint8_t y) {
+  uint32_t a = (uint32_t)x * (uint32_t)y; // -> 8-bit multiply
+  uint32_t b = a + 0x1234;                // -> 8-bit add of 0x34
+  return (uint8_t)(b ^ 0xFF00);           // -> the xor sets no stored bit
+}
+
+// Shift amounts up to 15 on a byte: must not become an 8-bit shift
+uint32_t test_narrow_shift(uint8_t x, uint8_t y) {
+  uint32_t a = (uint32_t)(y & 15); // 8..15 shift every bit of x out
+  return (uint32_t)x >> a;         // -> stays 32-bit
+}
+
+// Comparisons decided by the bits that are known
+int test_known_compare(uint32_t x) {
+  uint32_t odd = x | 1;
+  uint32_t low = x & 0xF;
+  int a = odd == 0;        // -> 0
+  int b = low < 16;        // -> 1
+  int c = (x << 8) & 0xFF; // -> 0
+  return a + b + c;
+}
+
+int main() {
+  srand(0);
+  uint32_t s = 0;
+  for (int i = 0; i < 10000000; ++i) {
+    uint32_t x = (uint32_t)rand();
+    uint32_t y = (uint32_t)i;
+    s += test_pack(x, y);
+    s ^= test_narrow((uint8_t)x, (uint8_t)y);
+    s += test_known_compare(x ^ y);
+    s ^= test_narrow_shift((uint8_t)x, (uint8_t)y);
+  }
+  printf("s = %u\n", s);
+  return 0;
+}
@@ -0,0 +1,66 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Boolean logic over comparisons of the same two values
+int test_compare_logic(int x, int y) {
+  int a = (x < y) || (x == y); // -> x <= y
+  int b = !(x != y);           // -> x == y
+  int c = a && b;              // -> x == y
+  int d = (x > y) ^ (x >= y);  // -> x == y
+  return (c == 1) + (d != 0);  // -> the compares themselves
+}
+
+// Branches on conditions that fold leave dead blocks behind
+uint32_t test_dead_branch(uint32_t x) {
+  uint32_t s = x;
+  if (x != x) // -> false, the block is removed
+    s = s * 7 + 3;
+  if ((x & 1) == 2) // -> false, the and leaves bit 1 clear
+    s ^= 0x55;
+  int flag = !(!(x == x)); // -> 1
+  if (flag)
+    s += 1;
+  return s;
+}
+
+// Selects whose outcome does not depend on the condition
+int test_select(int x, int y, int c) {
+  int a = c ? x : x;             // -> x
+  int b = (x == y) ? x : y;      // -> y
+  int e = !c ? a : b;            // -> c ? b : a
+  return e + ((x == y) ? 1 : 0); // -> zext of the compare
+}
+
+// Data-dependent diamonds in a loop -> selects, nothing to mispredict
+uint32_t test_diamond(const uint8_t *v, int n) {
+  uint32_t s = 0;
+  for (int i = 0; i < n; ++i) {
+    uint32_t x;
+    if (v[i] < 128)
+      x = s + v[i];
+    else
+      x = s ^ 0x5A;
+    s = x;
+  }
+  return s;
+}
+
+int main() {
+  srand(0);
+  uint32_t s = 0;
+  uint8_t v[256];
+  for (int i = 0; i < 256; ++i)
+    v[i] = (uint8_t)rand();
+  for (int i = 0; i < 10000000; ++i) {
+    int x = rand() & 0xFF;
+    int y = i & 0xFF;
+    s += test_compare_logic(x, y);
+    s ^= test_dead_branch((uint32_t)x * (uint32_t)i);
+    s += test_select(x, y, i & 1);
+    if (i % 64 == 0)
+      s += test_diamond(v, 256);
+  }
+  printf("s = %u\n", s);
+  return 0;
+}
@@ -0,0 +1,168 @@
+; Division and remainder by constants on x86_64, rules 16-19. Every one
+; must become multiplies and shifts under the default cost kind, and give
+; the results of the hardware divide for every dividend main tries
+
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+@.str = private unnamed_addr constant [8 x i8] c"s = %u\0A\00", align 1
+
+; CHECK-LABEL: define i32 @udiv_10(
+; CHECK-NOT: {{udiv|sdiv|urem|srem}}
+; CHECK: ret i32
+define i32 @udiv_10(i32 %x) {
+entry:
+  %r = udiv i32 %x, 10 ; -> multiply high and shift
+  ret i32 %r
+}
+
+; CHECK-LABEL: define i32 @sdiv_7(
+; CHECK-NOT: {{udiv|sdiv|urem|srem}}
+; CHECK: ret i32
+define i32 @sdiv_7(i32 %x) {
+entry:
+  %r = sdiv i32 %x, 7 ; -> multiply high, shifts and sign fixup
+  ret i32 %r
+}
+
+; CHECK-LABEL: define i32 @sdiv_neg3(
+; CHECK-NOT: {{udiv|sdiv|urem|srem}}
+; CHECK: ret i32
+define i32 @sdiv_neg3(i32 %x) {
+entry:
+  %r = sdiv i32 %x, -3 ; -> negated quotient by 3
+  ret i32 %r
+}
+
+; The x / 64 of extreme.c
+; CHECK-LABEL: define i32 @sdiv_64(
+; CHECK-NOT: {{udiv|sdiv|urem|srem}}
+; CHECK: ashr i32
+; CHECK-NOT: {{udiv|sdiv|urem|srem}}
+; CHECK: ret i32
+define i32 @sdiv_64(i32 %x) {
+entry:
+  %r = sdiv i32 %x, 64 ; -> shifts with bias fixup
+  ret i32 %r
+}
+
+; CHECK-LABEL: define i32 @urem_10(
+; CHECK-NOT: {{udiv|sdiv|urem|srem}}
+; CHECK: ret i32
+define i32 @urem_10(i32 %x) {
+entry:
+  %r = urem i32 %x, 10 ; -> x - (x / 10) * 10
+  ret i32 %r
+}
+
+; CHECK-LABEL: define i32 @srem_7(
+; CHECK-NOT: {{udiv|sdiv|urem|srem}}
+; CHECK: ret i32
+define i32 @srem_7(i32 %x) {
+entry:
+  %r = srem i32 %x, 7 ; -> x - (x / 7) * 7
+  ret i32 %r
+}
+
+; CHECK-LABEL: define i32 @srem_16(
+; CHECK-NOT: {{udiv|sdiv|urem|srem}}
+; CHECK: ret i32
+define i32 @srem_16(i32 %x) {
+entry:
+  %r = srem i32 %x, 16 ; -> biased mask
+  ret i32 %r
+}
+
+; The remainder reuses the quotient, which is then rewritten
+; CHECK-LABEL: define i32 @divrem_7(
+; CHECK-NOT: {{udiv|sdiv|urem|srem}}
+; CHECK: ret i32
+define i32 @divrem_7(i32 %x) {
+entry:
+  %q = sdiv i32 %x, 7
+  %r = srem i32 %x, 7
+  %m = mul i32 %q, 31
+  %s = add i32 %m, %r
+  ret i32 %s
+}
+
+; CHECK-LABEL: define i64 @udiv_1000_i64(
+; CHECK-NOT: {{udiv|sdiv|urem|srem}}
+; CHECK: ret i64
+define i64 @udiv_1000_i64(i64 %x) {
+entry:
+  %r = udiv i64 %x, 1000
+  ret i64 %r
+}
+
+; Folds every quotient and remainder of x into s
+define i32 @check(i32 %x, i32 %s) {
+entry:
+  %0 = call i32 @udiv_10(i32 %x)
+  %1 = call i32 @sdiv_7(i32 %x)
+  %2 = call i32 @sdiv_neg3(i32 %x)
+  %3 = call i32 @sdiv_64(i32 %x)
+  %4 = call i32 @urem_10(i32 %x)
+  %5 = call i32 @srem_7(i32 %x)
+  %6 = call i32 @srem_16(i32 %x)
+  %7 = call i32 @divrem_7(i32 %x)
+  %wide = zext i32 %x to i64
+  %shl = shl i64 %wide, 31
+  %xw = xor i64 %shl, %wide
+  %8 = call i64 @udiv_1000_i64(i64 %xw)
+  %9 = trunc i64 %8 to i32
+  %hi = lshr i64 %8, 32
+  %10 = trunc i64 %hi to i32
+  %m0 = mul i32 %s, 31
+  %a0 = add i32 %m0, %0
+  %m1 = mul i32 %a0, 31
+  %a1 = add i32 %m1, %1
+  %m2 = mul i32 %a1, 31
+  %a2 = add i32 %m2, %2
+  %m3 = mul i32 %a2, 31
+  %a3 = add i32 %m3, %3
+  %m4 = mul i32 %a3, 31
+  %a4 = add i32 %m4, %4
+  %m5 = mul i32 %a4, 31
+  %a5 = add i32 %m5, %5
+  %m6 = mul i32 %a5, 31
+  %a6 = add i32 %m6, %6
+  %m7 = mul i32 %a6, 31
+  %a7 = add i32 %m7, %7
+  %m8 = mul i32 %a7, 31
+  %a8 = add i32 %m8, %9
+  %m9 = mul i32 %a8, 31
+  %a9 = add i32 %m9, %10
+  ret i32 %a9
+}
+
+declare i32 @printf(i8*, ...)
+
+; Small dividends of both signs, random ones and the extremes
+define i32 @main() {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %seed = phi i32 [ 42, %entry ], [ %seed.next, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s2, %loop ]
+  %small = sub i32 %i, 100000
+  %s1 = call i32 @check(i32 %small, i32 %s)
+  %seed.next = mul i32 %seed, 1664525
+  %x = add i32 %seed.next, 1013904223
+  %s2 = call i32 @check(i32 %x, i32 %s1)
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, 200000
+  br i1 %done, label %edges, label %loop
+
+edges:
+  %e0 = call i32 @check(i32 -2147483648, i32 %s2)
+  %e1 = call i32 @check(i32 2147483647, i32 %e0)
+  %e2 = call i32 @check(i32 -1, i32 %e1)
+  %e3 = call i32 @check(i32 -2147483647, i32 %e2)
+  %e4 = call i32 @check(i32 -64, i32 %e3)
+  %e5 = call i32 @check(i32 -65, i32 %e4)
+  %0 = call i32 (i8*, ...) @printf(i8* getelementptr ([8 x i8], [8 x i8]* @.str, i32 0, i32 0), i32 %e5)
+  ret i32 0
+}
@@ -0,0 +1,67 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Min, max and abs spelled out with comparisons
+int test_min_max_abs(int x, int y) {
+  int lo = x < y ? x : y;      // -> smin(x, y)
+  int hi = x > y ? x : y;      // -> smax(x, y)
+  int mag = lo < 0 ? -lo : lo; // -> abs(lo)
+  unsigned u = (unsigned)hi;
+  unsigned cap = u < 1000 ? u : 1000; // -> umin(u, 1000)
+  return mag + (int)cap;
+}
+
+// Clamping a sample to a pixel
+uint8_t test_clamp(int v) {
+  int t = v > 255 ? 255 : v; // -> smin(v, 255)
+  return v < 0 ? 0 : t;      // -> smax(smin(v, 255), 0)
+}
+
+// Saturating arithmetic built from overflow checks
+uint32_t test_saturate(uint32_t a, uint32_t b, int8_t c, int8_t d) {
+  uint32_t sum = a + b;
+  uint32_t usum = sum < a ? UINT32_MAX : sum; // -> uadd.sat(a, b)
+  uint32_t udiff = a > b ? a - b : 0;         // -> usub.sat(a, b)
+  int s = c + d;
+  s = s > 127 ? 127 : s;
+  s = s < -128 ? -128 : s;
+  int8_t ssum = (int8_t)s; // -> sadd.sat(c, d)
+  return usum ^ udiff ^ (uint8_t)ssum;
+}
+
+// Rotates and byte swaps written with shifts
+uint32_t test_rotate_bswap(uint32_t x, uint32_t r) {
+  uint32_t a = (x << 13) | (x >> 19);              // -> fshl(x, x, 13)
+  uint32_t b = (a >> (r & 31)) | (a << (-r & 31)); // -> fshr(a, a, r)
+  return (b << 24) | ((b & 0xFF00) << 8) | ((b >> 8) & 0xFF00) |
+         (b >> 24); // -> bswap(b)
+}
+
+// Bit counts written as loops
+int test_count_loops(uint32_t x) {
+  int pop = 0;
+  for (uint32_t v = x; v; v &= v - 1) // -> ctpop(x)
+    pop++;
+  int width = 0;
+  for (uint32_t v = x; v; v >>= 1) // -> 32 - ctlz(x)
+    width++;
+  return pop * 64 + width;
+}
+
+int main() {
+  srand(0);
+  uint32_t s = 0;
+  for (int i = 0; i < 10000000; ++i) {
+    int x = rand() - RAND_MAX / 2;
+    int y = i - 5000000;
+    s += test_min_max_abs(x, y);
+    s ^= test_clamp(x >> 20);
+    s += test_saturate((uint32_t)x * 3u, (uint32_t)y * 7u, (int8_t)x,
+                       (int8_t)i);
+    s ^= test_rotate_bswap((uint32_t)x, (uint32_t)i);
+    s += test_count_loops((uint32_t)x * (uint32_t)i);
+  }
+  printf("s = %u\n", s);
+  return 0;
+}
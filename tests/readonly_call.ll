@@ -0,0 +1,140 @@
+; Allocas bracketed by lifetime markers whose address is passed to a
+; read-only call. Run through both mysroa and mysroa-fast by test.sh
+
+@.str = private unnamed_addr constant [8 x i8] c"s = %u\0A\00", align 1
+
+define i32 @peek(i32* nocapture readonly %p) noinline {
+entry:
+  %0 = load i32, i32* %p, align 4
+  %mul = mul i32 %0, 7
+  %add = add i32 %mul, 1
+  ret i32 %add
+}
+
+; The call reads a copy of the local, which must hold the value stored
+; before the call and not the one stored after it
+; CHECK-LABEL: define i32 @test_store_around_call(
+; CHECK-NOT: lifetime
+; CHECK: store i32 %x, i32* %v.copy
+; CHECK-NEXT: call i32 @peek(i32* %v.copy)
+; CHECK: store i32 %y, i32* %v.copy
+; CHECK-NEXT: call i32 @peek(i32* %v.copy)
+; CHECK-NOT: lifetime
+; CHECK: ret i32
+define i32 @test_store_around_call(i32 %x) {
+entry:
+  %v = alloca i32, align 4
+  %0 = bitcast i32* %v to i8*
+  call void @llvm.lifetime.start.p0i8(i64 4, i8* %0) ; -> deleted
+  store i32 %x, i32* %v, align 4
+  %r = call i32 @peek(i32* %v) ; -> peek(&v.copy), v.copy = x
+  %y = add i32 %x, 5
+  store i32 %y, i32* %v, align 4
+  %r2 = call i32 @peek(i32* %v) ; -> v.copy = x + 5
+  %1 = load i32, i32* %v, align 4
+  %s = add i32 %r, %r2
+  %sum = xor i32 %s, %1
+  call void @llvm.lifetime.end.p0i8(i64 4, i8* %0) ; -> deleted
+  ret i32 %sum
+}
+
+; A local read by the call in a loop -> copied right before each call
+; CHECK-LABEL: define i32 @test_call_in_loop(
+; CHECK-NOT: %v = alloca
+; CHECK: loop:
+; CHECK: store i32 %x, i32* %v.copy
+; CHECK-NEXT: call i32 @peek(i32* %v.copy)
+; CHECK: ret i32
+define i32 @test_call_in_loop(i32 %x, i32 %n) {
+entry:
+  %v = alloca i32, align 4
+  %0 = bitcast i32* %v to i8*
+  call void @llvm.lifetime.start.p0i8(i64 4, i8* %0)
+  store i32 %x, i32* %v, align 4
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s.next, %loop ]
+  %r = call i32 @peek(i32* %v)
+  %s.next = add i32 %s, %r
+  %i.next = add i32 %i, 1
+  %cmp = icmp ult i32 %i.next, %n
+  br i1 %cmp, label %loop, label %exit
+
+exit:
+  %1 = load i32, i32* %v, align 4
+  call void @llvm.lifetime.end.p0i8(i64 4, i8* %0)
+  %sum = add i32 %s.next, %1
+  ret i32 %sum
+}
+
+; Stores in both arms need a dominator tree. mysroa promotes the local and
+; copies it for the call, mysroa-fast leaves the function as it is
+; SROA-LABEL: define i32 @test_store_in_both_arms(
+; SROA-NOT: lifetime
+; SROA: %v.copy = alloca i32
+; SROA-NOT: %v = alloca
+; SROA: call i32 @peek(i32* %v.copy)
+; FAST-LABEL: define i32 @test_store_in_both_arms(
+; FAST-NEXT: entry:
+; FAST-NEXT: %v = alloca i32
+; FAST-NEXT: bitcast
+; FAST-NEXT: call void @llvm.lifetime.start
+; FAST-NOT: %v.copy
+; FAST: call i32 @peek(i32* %v)
+; FAST: call void @llvm.lifetime.end
+define i32 @test_store_in_both_arms(i32 %x) {
+entry:
+  %v = alloca i32, align 4
+  %0 = bitcast i32* %v to i8*
+  call void @llvm.lifetime.start.p0i8(i64 4, i8* %0)
+  %cmp = icmp slt i32 %x, 0
+  br i1 %cmp, label %neg, label %pos
+
+neg:
+  %sub = sub i32 0, %x
+  store i32 %sub, i32* %v, align 4
+  br label %join
+
+pos:
+  store i32 %x, i32* %v, align 4
+  br label %join
+
+join:
+  %r = call i32 @peek(i32* %v)
+  %1 = load i32, i32* %v, align 4
+  call void @llvm.lifetime.end.p0i8(i64 4, i8* %0)
+  %sum = add i32 %r, %1
+  ret i32 %sum
+}
+
+declare void @llvm.lifetime.start.p0i8(i64, i8* nocapture)
+declare void @llvm.lifetime.end.p0i8(i64, i8* nocapture)
+declare i32 @printf(i8*, ...)
+
+define i32 @main() {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %seed = phi i32 [ 42, %entry ], [ %seed.next, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s.next, %loop ]
+  %seed.next = add i32 %seed, 1013904223
+  %x = mul i32 %seed.next, 1664525
+  %n = and i32 %x, 15
+  %0 = call i32 @test_store_around_call(i32 %x)
+  %1 = call i32 @test_call_in_loop(i32 %x, i32 %n)
+  %2 = call i32 @test_store_in_both_arms(i32 %x)
+  %3 = xor i32 %0, %1
+  %4 = add i32 %3, %2
+  %s.next = add i32 %s, %4
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, 1000
+  br i1 %done, label %exit, label %loop
+
+exit:
+  %5 = call i32 (i8*, ...) @printf(i8* getelementptr ([8 x i8], [8 x i8]* @.str, i32 0, i32 0), i32 %s.next)
+  ret i32 0
+}
@@ -0,0 +1,110 @@
+; Allocas the SROA pass promotes without a dominator tree, in the shape
+; clang emits at -O0. Run through both mysroa and mysroa-fast by test.sh
+
+@.str = private unnamed_addr constant [8 x i8] c"s = %u\0A\00", align 1
+
+; Every access in one block -> promoted by the local scan
+; CHECK-LABEL: define i32 @test_single_block(
+; CHECK-NOT: alloca
+; CHECK: ret i32
+define i32 @test_single_block(i32 %a, i32 %b) {
+entry:
+  %a.addr = alloca i32, align 4
+  %b.addr = alloca i32, align 4
+  %t = alloca i32, align 4
+  store i32 %a, i32* %a.addr, align 4
+  store i32 %b, i32* %b.addr, align 4
+  %0 = load i32, i32* %a.addr, align 4
+  %1 = load i32, i32* %b.addr, align 4
+  %xor = xor i32 %0, %1
+  store i32 %xor, i32* %t, align 4
+  %2 = load i32, i32* %t, align 4
+  %mul = mul i32 %2, 3
+  store i32 %mul, i32* %t, align 4 ; -> a second store, still one block
+  %3 = load i32, i32* %t, align 4
+  %4 = load i32, i32* %a.addr, align 4
+  %add = add i32 %3, %4
+  ret i32 %add
+}
+
+; Parameters stored once in the entry block and read in the loop
+; -> every load takes the stored value
+; CHECK-LABEL: define i32 @test_single_store(
+; CHECK-NOT: alloca
+; CHECK: ret i32
+define i32 @test_single_store(i32 %x, i32 %n) {
+entry:
+  %x.addr = alloca i32, align 4
+  %n.addr = alloca i32, align 4
+  store i32 %x, i32* %x.addr, align 4
+  store i32 %n, i32* %n.addr, align 4
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %body ]
+  %s = phi i32 [ 0, %entry ], [ %s.next, %body ]
+  %0 = load i32, i32* %n.addr, align 4
+  %cmp = icmp ult i32 %i, %0
+  br i1 %cmp, label %body, label %exit
+
+body:
+  %1 = load i32, i32* %x.addr, align 4
+  %2 = xor i32 %1, %i
+  %s.next = add i32 %s, %2
+  %i.next = add i32 %i, 1
+  br label %loop
+
+exit:
+  %3 = load i32, i32* %x.addr, align 4
+  %r = add i32 %s, %3
+  ret i32 %r
+}
+
+; Every access in a block other than the alloca's -> promoted locally too
+; CHECK-LABEL: define i32 @test_store_in_branch(
+; CHECK-NOT: alloca
+; CHECK: ret i32
+define i32 @test_store_in_branch(i32 %x) {
+entry:
+  %v = alloca i32, align 4
+  %cmp = icmp ugt i32 %x, 7
+  br i1 %cmp, label %then, label %done
+
+then:
+  store i32 %x, i32* %v, align 4
+  %0 = load i32, i32* %v, align 4
+  %1 = lshr i32 %0, 1
+  ret i32 %1
+
+done:
+  ret i32 %x
+}
+
+declare i32 @printf(i8*, ...)
+
+define i32 @main() {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %seed = phi i32 [ 42, %entry ], [ %seed.next, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s.next, %loop ]
+  %seed.next = add i32 %seed, 1013904223
+  %x = mul i32 %seed.next, 1664525
+  %y = lshr i32 %x, 16
+  %n = and i32 %x, 15
+  %0 = call i32 @test_single_block(i32 %x, i32 %y)
+  %1 = call i32 @test_single_store(i32 %y, i32 %n)
+  %2 = call i32 @test_store_in_branch(i32 %n)
+  %3 = xor i32 %0, %1
+  %4 = add i32 %3, %2
+  %s.next = add i32 %s, %4
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, 1000
+  br i1 %done, label %exit, label %loop
+
+exit:
+  %5 = call i32 (i8*, ...) @printf(i8* getelementptr ([8 x i8], [8 x i8]* @.str, i32 0, i32 0), i32 %s.next)
+  ret i32 0
+}
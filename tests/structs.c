@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct pair {
+  int first, second;
+};
+
+struct vec3 {
+  float x, y, z;
+};
+
+// Small structs passed and returned by value
+struct pair test_swap(struct pair p) {
+  struct pair r = {p.second, p.first}; // -> two registers, no stack slot
+  return r;
+}
+
+// Struct copies and per-field updates
+float test_vec3(struct vec3 a, float s) {
+  struct vec3 b = a; // -> field-by-field copy
+  b.x *= s;
+  b.y *= s;
+  b.z *= s;
+  return b.x + b.y * 2 + b.z * 3;
+}
+
+// Iterator state kept in a local struct
+uint32_t test_iter(uint32_t seed) {
+  struct {
+    uint32_t state;
+    int steps;
+  } it = {seed, 0}; // -> the fields become SSA values
+  while (it.steps < 8) {
+    it.state = it.state * 1664525u + 1013904223u;
+    it.steps++;
+  }
+  return it.state;
+}
+
+// A tiny array indexed by the loop counter
+int test_small_array(int x) {
+  int v[4] = {1, 2, 3, 4}; // -> one <4 x i32> value
+  v[2] = x;
+  int s = 0;
+  for (int i = 0; i < 4; ++i) {
+    s += v[i]; // -> extractelement
+    v[i] *= 3; // -> insertelement
+  }
+  return s + v[0];
+}
+
+int main() {
+  srand(0);
+  uint32_t s = 0;
+  float f = 0;
+  for (int i = 0; i < 10000000; ++i) {
+    struct pair p = {rand(), i};
+    p = test_swap(p);
+    s += (uint32_t)(p.first - p.second);
+    struct vec3 v = {(float)(i & 0xFF), 1.5f, (float)(p.first & 7)};
+    f += test_vec3(v, 0.5f);
+    s ^= test_iter((uint32_t)i);
+    s += test_small_array(i);
+  }
+  printf("s = %u, f = %.1f\n", s, f);
+  return 0;
+}
@@ -162,6 +162,52 @@ for TEST_FILE in "$TEST_DIR"/*.c; do
     fi
 done
 
+# IR tests cover what clang does not emit at -O0, such as lifetime markers,
+# argument attributes or a target triple. Each one runs through both SROA
+# variants and must print what it prints unoptimized. Its IR is checked by
+# FileCheck: CHECK lines hold for both variants, SROA lines for mysroa and
+# FAST lines for mysroa-fast
+for TEST_FILE in "$TEST_DIR"/*.ll; do
+    if [ -f "$TEST_FILE" ]; then
+        echo "Running IR test: $TEST_FILE" | tee -a "$LOG_FILE"
+
+        BASENAME=$(basename "$TEST_FILE" .ll)
+        RUN_OUTPUT_WITHOUT_PASS="${OUTPUT_DIR}/${BASENAME}_output_without_pass.txt"
+        lli "$TEST_FILE" >"$RUN_OUTPUT_WITHOUT_PASS"
+
+        RESULT="PASSED"
+        for VARIANT in mysroa:SROA mysroa-fast:FAST; do
+            SROA=${VARIANT%:*}
+            IR_WITH_PASS="${OUTPUT_DIR}/${BASENAME}_with_${SROA}.ll"
+            RUN_OUTPUT_WITH_PASS="${OUTPUT_DIR}/${BASENAME}_output_with_${SROA}.txt"
+            opt -load-pass-plugin "build/src/PeepHole/PeepHolePass.so" \
+                -load-pass-plugin "build/src/sroa/SROAPass.so" \
+                -passes="$SROA,peephole,verify" "$TEST_FILE" -S -o "$IR_WITH_PASS"
+            lli "$IR_WITH_PASS" >"$RUN_OUTPUT_WITH_PASS"
+            if cmp -s "$RUN_OUTPUT_WITHOUT_PASS" "$RUN_OUTPUT_WITH_PASS"; then
+                OUTPUT_CHECK="Outputs match"
+            else
+                OUTPUT_CHECK="Outputs differ"
+                RESULT="FAILED"
+            fi
+            if FileCheck --allow-unused-prefixes \
+                --check-prefixes="CHECK,${VARIANT#*:}" "$TEST_FILE" \
+                <"$IR_WITH_PASS" 2>>"$LOG_FILE"; then
+                IR_CHECK="IR matches"
+            else
+                IR_CHECK="IR differs"
+                RESULT="FAILED"
+            fi
+            echo "Output check with $SROA: $OUTPUT_CHECK" | tee -a "$LOG_FILE"
+            echo "IR check with $SROA:     $IR_CHECK" | tee -a "$LOG_FILE"
+            rm -f "$IR_WITH_PASS"
+        done
+
+        echo "Test $TEST_FILE: $RESULT" | tee -a "$LOG_FILE"
+        echo "---------------------------------" | tee -a "$LOG_FILE"
+    fi
+done
+
 echo "Testing complete. Results saved in $LOG_FILE."
 #
 # #!/bin/bash
@@ -0,0 +1,47 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef uint32_t v4su __attribute__((vector_size(16)));
+
+// 64-bit versions of the identity and strength reduction patterns
+uint64_t test_wide_scalar(uint64_t x) {
+  uint64_t a = x * 64;        // -> x << 6
+  uint64_t b = a / 16;        // -> a >> 4
+  uint64_t c = (b + 0) * 1;   // -> b
+  uint64_t d = (x ^ x) | c;   // -> c
+  return d - 0 + (x * 0);     // -> c
+}
+
+// The same patterns on <4 x i32> with splat constants
+v4su test_vector(v4su x) {
+  v4su a = x * 8;             // -> x << 3
+  v4su b = a / 4;             // -> a >> 2
+  v4su c = (b | 0) - 0;       // -> b
+  v4su d = (x & x) ^ (x | x); // -> 0
+  return c + d + x * 1;       // -> b + x
+}
+
+// Quotient and remainder of the same division, and a multiply-high bucket
+uint32_t test_divmod_mulhi(uint32_t x, uint32_t n) {
+  uint32_t q = x / n;                               // one division
+  uint32_t r = x % n;                               // -> x - q * n
+  uint32_t b = (uint32_t)(((uint64_t)x * n) >> 32); // multiply-high
+  return q ^ r ^ b;
+}
+
+int main() {
+  srand(0);
+  uint64_t s = 0;
+  v4su acc = {0, 0, 0, 0};
+  for (int i = 0; i < 10000000; ++i) {
+    uint64_t x = ((uint64_t)rand() << 20) | (uint64_t)i;
+    s ^= test_wide_scalar(x);
+    v4su v = {(uint32_t)rand(), (uint32_t)i, (uint32_t)-i, 7};
+    acc ^= test_vector(v);
+    s += test_divmod_mulhi((uint32_t)x, (uint32_t)i | 1);
+  }
+  printf("s = %llu\n", (unsigned long long)s);
+  printf("acc = %u %u %u %u\n", acc[0], acc[1], acc[2], acc[3]);
+  return 0;
+}